@@ -0,0 +1,562 @@
+// Micro-benchmarks of the server's message path: the cipher, timestamps, the
+// rate check, session timers, history writes and replays, broadcast fan-out
+// from 10 to 100k members, a burst of broadcasts with and without output
+// coalescing, and the per-recipient delivery time of a fan-out, sequential
+// and on the pool. Every result is one JSON object per line, so runs can be
+// diffed between releases or fed to jq. Build and run with `make bench`;
+// `bench/server_bench broadcast` runs only benchmarks whose name contains
+// "broadcast".
+//
+// Fan-out never needs real peers. The "discard" sink points every member at
+// one connected UDP socket whose receiver is never read: each send() is a real
+// syscall, and once the receive buffer is full the kernel drops the datagrams.
+// The "socketpair" sink gives each member its own AF_UNIX stream pair, drained
+// outside the timed region, for as many members as the fd limit allows.
+// "fanout_latency" shares one UDP socket among all members as well, but its
+// receiver timestamps every datagram in the kernel; since loopback delivers
+// inside sendmsg, that is when each member's copy went out.
+
+#define OPTICOM_NO_MAIN
+#include "../opticom.cpp"
+#include <filesystem>
+#include <future>
+#include <linux/net_tstamp.h>
+
+// Consumed results, so the compiler cannot drop the work being timed
+static volatile size_t benchSink;
+
+static string benchFilter;
+
+static bool selected(const string &name)
+{
+    return benchFilter.empty() || name.find(benchFilter) != string::npos;
+}
+
+// `"key":value` pieces for report(); strings are quoted, numbers are not
+static string field(const string &key, const string &value)
+{
+    return ",\"" + key + "\":\"" + value + "\"";
+}
+
+static string field(const string &key, double value)
+{
+    ostringstream out;
+    out << ",\"" << key << "\":" << fixed << setprecision(1) << value;
+    return out.str();
+}
+
+static string field(const string &key, size_t value)
+{
+    return ",\"" + key + "\":" + to_string(value);
+}
+
+static void report(const string &name, const string &fields, uint64_t iterations, double nsPerOp)
+{
+    cout << "{\"bench\":\"" << name << "\"" << fields << field("iterations", static_cast<size_t>(iterations))
+         << field("ns_per_op", nsPerOp) << "}" << endl;
+}
+
+struct Timing
+{
+    uint64_t iterations = 0;
+    double nsPerOp = 0;
+};
+
+// Calls op() in batches until 0.2 s have been timed. between() runs after
+// every batch and is left out of the measurement.
+template <typename Op, typename Between>
+static Timing measure(size_t batch, Op &&op, Between &&between)
+{
+    Timing t;
+    chrono::duration<double, nano> timed{};
+    do
+    {
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < batch; ++i)
+            op();
+        timed += chrono::steady_clock::now() - start;
+        t.iterations += batch;
+        between();
+    } while (timed.count() < 0.2e9);
+    t.nsPerOp = timed.count() / t.iterations;
+    return t;
+}
+
+template <typename Op>
+static Timing measure(size_t batch, Op &&op)
+{
+    return measure(batch, op, [] {});
+}
+
+// A connected UDP socket nobody reads; sends succeed and are dropped once the
+// receiver's buffer is full
+static pair<int, int> openDiscardSink()
+{
+    int receiver = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int sender = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (receiver < 0 || sender < 0 || bind(receiver, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        getsockname(receiver, reinterpret_cast<sockaddr *>(&addr), &len) < 0 ||
+        connect(sender, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+        throw runtime_error("Failed to open the discard sink");
+    return {sender, receiver};
+}
+
+// Like the discard sink, but the receiver records when each datagram arrived
+// and has room for `bufferBytes` of them (more than the usual rmem_max when
+// running as root)
+static pair<int, int> openTimestampSink(int bufferBytes)
+{
+    pair<int, int> sink = openDiscardSink();
+    int on = 1;
+    if (setsockopt(sink.second, SOL_SOCKET, SO_RCVBUFFORCE, &bufferBytes, sizeof(bufferBytes)) != 0)
+        setsockopt(sink.second, SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes));
+    setsockopt(sink.second, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+    setsockopt(sink.second, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+    return sink;
+}
+
+// Reads everything queued on a timestamp sink: arrival times in ns since the
+// epoch, and the receiver's running count of datagrams it had to drop
+static void drainTimestamps(int receiver, vector<int64_t> &arrivals, uint32_t &dropped)
+{
+    char data[2048];
+    alignas(cmsghdr) char control[256];
+    while (true)
+    {
+        iovec iov{data, sizeof(data)};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(receiver, &msg, MSG_DONTWAIT) < 0)
+            return;
+        for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+        {
+            if (c->cmsg_level != SOL_SOCKET)
+                continue;
+            if (c->cmsg_type == SCM_TIMESTAMPNS)
+            {
+                timespec ts;
+                memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+                arrivals.push_back(ts.tv_sec * 1000000000LL + ts.tv_nsec);
+            }
+            else if (c->cmsg_type == SO_RXQ_OVFL)
+                memcpy(&dropped, CMSG_DATA(c), sizeof(dropped));
+        }
+    }
+}
+
+static int64_t realtimeNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts); // the clock SO_TIMESTAMPNS stamps with
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static size_t raiseFdLimit()
+{
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return 1024;
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    return rl.rlim_cur;
+}
+
+struct ServerBench
+{
+    ChatServer &server;
+    int discard;
+
+    static constexpr const char *ROOM = "bench";
+
+    // The history thread is all of start() a benchmark needs; no sockets are opened
+    ServerBench(ChatServer &s, int sink) : server(s), discard(sink)
+    {
+        server.history.start();
+    }
+
+    // A framed, fully handshaken session writing to `socket`, already in `room`
+    shared_ptr<ClientInfo> member(int socket, const string &name, const string &room)
+    {
+        auto c = make_shared<ClientInfo>(socket, name, "bench", room);
+        c->protocol = ClientInfo::Protocol::Framed;
+        c->state = ClientInfo::State::Active;
+        c->userId = server.userIds.acquire(name);
+        server.registry.join(c, room);
+        return c;
+    }
+
+    void leaveAll(const vector<shared_ptr<ClientInfo>> &members)
+    {
+        for (auto &c : members)
+            server.registry.leave(c);
+    }
+
+    static string chatLine(size_t i)
+    {
+        return "[" + ChatServer::nowTimestamp() + "] user" + to_string(i % 1000) + ": the quick brown fox jumps over the lazy dog";
+    }
+
+    // Returns once the history thread has written everything queued so far
+    void waitForHistory()
+    {
+        promise<void> done;
+        server.history.post([&done] { done.set_value(); });
+        done.get_future().wait();
+    }
+
+    void encrypt()
+    {
+        if (!selected("encrypt"))
+            return;
+        for (size_t size : {64, 1024})
+        {
+            string line(size, 'a');
+            Timing t = measure(1024, [&] { benchSink = benchSink + Encryption::encrypt(line).size(); });
+            report("encrypt", field("bytes", size) + field("kernel", Encryption::kernelName()), t.iterations, t.nsPerOp);
+        }
+    }
+
+    void timestamp()
+    {
+        if (!selected("nowTimestamp"))
+            return;
+        Timing t = measure(1024, [] { benchSink = benchSink + ChatServer::nowTimestamp().size(); });
+        report("nowTimestamp", "", t.iterations, t.nsPerOp);
+    }
+
+    // What chatMessage does before a message may pass: the rules snapshot
+    // lookup, then the token bucket
+    void rateCheck()
+    {
+        if (!selected("rate_check"))
+            return;
+        server.rules.update([](ChatRules &r) {
+            for (int i = 0; i < 64; ++i)
+                r.rooms["room" + to_string(i)].slowmodeSeconds = 1;
+        });
+        auto c = member(discard, "ratecheck", "general");
+        struct Case
+        {
+            const char *outcome;
+            RateLimit limit;
+        };
+        for (const Case &k : {Case{"pass", RateLimit{1e12, 1e12}}, Case{"limited", RateLimit{3, 3}}})
+        {
+            server.rules.update([&k](ChatRules &r) { r.rate = k.limit; });
+            Timing t = measure(1024, [&] {
+                RateLimit rate;
+                int slowSeconds;
+                server.roomLimits(c->room, rate, slowSeconds);
+                benchSink = benchSink + c->rateBucket.tryTake(rate, TokenBucket::nowNs()) + slowSeconds;
+            });
+            report("rate_check", field("outcome", k.outcome), t.iterations, t.nsPerOp);
+        }
+        server.rules.update([this](ChatRules &r) { r = ChatRules{server.config.rateLimit, {}}; });
+        leaveAll({c});
+    }
+
+    // Session deadlines with 100k timers spread over ten minutes: re-arming one,
+    // as every fired keepalive check does, and firing them all tick by tick
+    void timerWheel()
+    {
+        if (!selected("timer_wheel"))
+            return;
+        const size_t TIMERS = 100000;
+        const int64_t SPAN = 600 * ChatServer::NS_PER_SECOND;
+        auto spread = [SPAN](size_t i) { return static_cast<int64_t>((i * 2654435761ULL) % SPAN); };
+        TimerWheel wheel(IoLoop::TICK_NS, 0);
+        vector<TimerWheel::Timer> timers(TIMERS);
+        size_t fired = 0;
+        for (size_t i = 0; i < TIMERS; ++i)
+        {
+            timers[i].setCallback([&fired] { ++fired; });
+            wheel.schedule(timers[i], spread(i));
+        }
+
+        size_t next = 0;
+        Timing t = measure(1024, [&] {
+            size_t i = next++ % TIMERS;
+            wheel.schedule(timers[i], spread(i + next));
+        });
+        report("timer_wheel", field("op", string("rearm")) + field("timers", TIMERS), t.iterations, t.nsPerOp);
+
+        auto start = chrono::steady_clock::now();
+        for (int64_t now = 0; now <= SPAN + IoLoop::TICK_NS; now += IoLoop::TICK_NS)
+            wheel.advance(now);
+        chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+        report("timer_wheel", field("op", string("fire")) + field("timers", TIMERS), fired, elapsed.count() / fired);
+    }
+
+    // The caller's side only: the ring append and the hand-off to the history thread
+    void saveMessage()
+    {
+        if (!selected("saveMessage"))
+            return;
+        string line = chatLine(0);
+        Timing t = measure(256, [&] { server.saveMessage(ROOM, line); });
+        report("saveMessage", field("bytes", line.size()), t.iterations, t.nsPerOp);
+        waitForHistory();
+    }
+
+    // `source` is "cache" when the server keeps recent messages in memory,
+    // "disk" when it has to replay the segments on the history thread. The disk
+    // case includes the hand-off and waits for the replay to be sent.
+    void sendRoomHistory(const string &source)
+    {
+        if (!selected("sendRoomHistory"))
+            return;
+        for (size_t i = 0; i < server.config.historyReplay * 2; ++i)
+            server.saveMessage(ROOM, chatLine(i));
+        waitForHistory();
+        auto c = member(discard, "replayer", ROOM);
+        Timing t = measure(source == "disk" ? 16 : 256, [&] {
+            server.sendRoomHistory(c, ROOM);
+            if (source == "disk")
+                waitForHistory();
+        });
+        report("sendRoomHistory", field("source", source) + field("lines", server.config.historyReplay), t.iterations,
+               t.nsPerOp);
+        leaveAll({c});
+    }
+
+    void broadcast(size_t fdLimit)
+    {
+        if (!selected("broadcast"))
+            return;
+        string message = chatLine(7);
+        for (size_t size : {10, 100, 1000, 10000, 100000})
+        {
+            string room = "fanout" + to_string(size);
+            vector<shared_ptr<ClientInfo>> members;
+            members.reserve(size);
+            for (size_t i = 0; i < size; ++i)
+                members.push_back(member(discard, room + "-" + to_string(i), room));
+            auto sender = members.front();
+            Timing t = measure(1, [&] { server.broadcastMessage(message, sender.get(), room); });
+            report("broadcast", field("sink", string("discard")) + field("members", size) +
+                   field("ns_per_member", t.nsPerOp / size), t.iterations, t.nsPerOp);
+            leaveAll(members);
+        }
+
+        for (size_t size : {10, 100, 1000, 10000, 100000})
+        {
+            if (size * 2 + 64 > fdLimit)
+            {
+                cerr << "broadcast/socketpair: skipping " << size << " members, fd limit is " << fdLimit << endl;
+                continue;
+            }
+            string room = "pairs" + to_string(size);
+            vector<shared_ptr<ClientInfo>> members;
+            vector<int> peers;
+            members.reserve(size);
+            for (size_t i = 0; i < size; ++i)
+            {
+                int fds[2];
+                if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0)
+                    throw runtime_error("socketpair failed");
+                peers.push_back(fds[1]);
+                members.push_back(member(fds[0], room + "-" + to_string(i), room));
+            }
+            auto sender = members.front();
+            char buffer[4096];
+            auto drain = [&] {
+                for (int peer : peers)
+                {
+                    while (read(peer, buffer, sizeof(buffer)) > 0)
+                    {
+                    }
+                }
+            };
+            Timing t = measure(1, [&] { server.broadcastMessage(message, sender.get(), room); }, drain);
+            report("broadcast", field("sink", string("socketpair")) + field("members", size) +
+                   field("ns_per_member", t.nsPerOp / size), t.iterations, t.nsPerOp);
+            leaveAll(members);
+            for (size_t i = 0; i < size; ++i)
+            {
+                close(members[i]->socket);
+                close(peers[i]);
+            }
+        }
+    }
+
+    // Several messages to one room in the same tick, written as they are
+    // queued or coalesced by an OutputBatch into one sendmsg per member
+    void broadcastBurst(size_t fdLimit)
+    {
+        if (!selected("broadcast_burst"))
+            return;
+        const size_t size = 1000, burst = 8;
+        if (size * 2 + 64 > fdLimit)
+        {
+            cerr << "broadcast_burst: skipping, fd limit is " << fdLimit << endl;
+            return;
+        }
+        string message = chatLine(3), room = "burst";
+        vector<shared_ptr<ClientInfo>> members;
+        vector<int> peers;
+        for (size_t i = 0; i < size; ++i)
+        {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0)
+                throw runtime_error("socketpair failed");
+            peers.push_back(fds[1]);
+            members.push_back(member(fds[0], room + "-" + to_string(i), room));
+        }
+        auto sender = members.front();
+        char buffer[4096];
+        auto drain = [&] {
+            for (int peer : peers)
+            {
+                while (read(peer, buffer, sizeof(buffer)) > 0)
+                {
+                }
+            }
+        };
+        for (bool batched : {false, true})
+        {
+            uint64_t sendsBefore = Metrics::collect().counters[Metrics::SendCalls];
+            Timing t = measure(1, [&] {
+                unique_ptr<ChatServer::OutputBatch> batch;
+                if (batched)
+                    batch.reset(new ChatServer::OutputBatch(server));
+                for (size_t i = 0; i < burst; ++i)
+                    server.broadcastMessage(message, sender.get(), room);
+            }, drain);
+            uint64_t sends = Metrics::collect().counters[Metrics::SendCalls] - sendsBefore;
+            report("broadcast_burst", field("batched", string(batched ? "yes" : "no")) + field("members", size) +
+                   field("messages", burst) + field("sends_per_member", static_cast<double>(sends) / (t.iterations * size)),
+                   t.iterations, t.nsPerOp);
+        }
+        leaveAll(members);
+        for (size_t i = 0; i < size; ++i)
+        {
+            close(members[i]->socket);
+            close(peers[i]);
+        }
+    }
+
+    // When each member's copy of one broadcast left, relative to the start of
+    // the call: p50/p99/max over a few rounds per room size, once sequential
+    // and once split across the fan-out pool
+    void fanoutLatency()
+    {
+        if (!selected("fanout_latency"))
+            return;
+        const size_t ROUNDS = 5;
+        string message = chatLine(9);
+        size_t configured = server.config.parallelFanout;
+        size_t threads = configured > 0 ? server.fanoutWorkers().threads() : 0;
+        for (size_t size : {1000, 5000, 20000, 50000})
+        {
+            auto sink = openTimestampSink(static_cast<int>(min<size_t>(size * 2048, 256 << 20)));
+            string room = "latency" + to_string(size);
+            vector<shared_ptr<ClientInfo>> members;
+            members.reserve(size);
+            for (size_t i = 0; i < size; ++i)
+                members.push_back(member(sink.first, room + "-" + to_string(i), room));
+
+            for (bool parallel : {false, true})
+            {
+                if (parallel && threads == 0)
+                    continue;
+                server.config.parallelFanout = parallel ? 1 : 0;
+                vector<int64_t> delays, arrivals;
+                uint32_t dropped = 0, droppedBefore = 0;
+                drainTimestamps(sink.second, arrivals, droppedBefore);
+                chrono::duration<double, nano> total{};
+                for (size_t round = 0; round < ROUNDS; ++round)
+                {
+                    arrivals.clear();
+                    int64_t start = realtimeNs();
+                    auto began = chrono::steady_clock::now();
+                    server.broadcastMessage(message, nullptr, room);
+                    total += chrono::steady_clock::now() - began;
+                    drainTimestamps(sink.second, arrivals, dropped);
+                    for (int64_t at : arrivals)
+                        delays.push_back(at - start);
+                }
+                sort(delays.begin(), delays.end());
+                auto quantileUs = [&delays](double q) {
+                    return delays.empty() ? 0.0 : delays[static_cast<size_t>(q * (delays.size() - 1))] / 1000.0;
+                };
+                report("fanout_latency", field("mode", string(parallel ? "parallel" : "sequential")) +
+                       field("members", size) + field("threads", parallel ? threads : size_t(0)) +
+                       field("p50_us", quantileUs(0.5)) + field("p99_us", quantileUs(0.99)) +
+                       field("max_us", quantileUs(1.0)) + field("dropped", static_cast<size_t>(dropped - droppedBefore)),
+                       ROUNDS, total.count() / ROUNDS);
+            }
+            leaveAll(members);
+            close(sink.first);
+            close(sink.second);
+        }
+        server.config.parallelFanout = configured;
+    }
+};
+
+// Each server gets a fresh working directory, since history lives under ./history
+template <typename Run>
+static void withServer(const string &dir, const ServerConfig &config, int sink, Run &&run)
+{
+    filesystem::create_directory(dir);
+    if (chdir(dir.c_str()) != 0)
+        throw runtime_error("Failed to enter " + dir);
+    {
+        ChatServer server(config);
+        ServerBench bench(server, sink);
+        run(bench);
+    }
+    if (chdir("..") != 0)
+        throw runtime_error("Failed to leave " + dir);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        benchFilter = argv[1];
+    signal(SIGPIPE, SIG_IGN);
+    size_t fdLimit = raiseFdLimit();
+
+    char scratch[] = "/tmp/opticom-bench-XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) != 0)
+    {
+        cerr << "Failed to create a scratch directory" << endl;
+        return 1;
+    }
+    auto sink = openDiscardSink();
+    try
+    {
+        ServerConfig config;
+        withServer("cached", config, sink.first, [&](ServerBench &b) {
+            b.encrypt();
+            b.timestamp();
+            b.rateCheck();
+            b.timerWheel();
+            b.saveMessage();
+            b.sendRoomHistory("cache");
+            b.broadcast(fdLimit);
+            b.broadcastBurst(fdLimit);
+            b.fanoutLatency();
+        });
+
+        config.cacheRoomBytes = 0; // every replay goes to the segments
+        withServer("uncached", config, sink.first, [](ServerBench &b) { b.sendRoomHistory("disk"); });
+    }
+    catch (const exception &e)
+    {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+
+    close(sink.first);
+    close(sink.second);
+    filesystem::remove_all(scratch);
+    return 0;
+}
@@ -2,36 +2,26 @@
 #include <string>
 #include <thread>
 #include <cstring>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string_view>
+#include <vector>
+#include "framing.h"
 
 using namespace std;
 
-// Simple XOR encryption/decryption (must match server)
-namespace Encryption
-{
-    const string KEY = "OpticomSecureKey2025"; // Shared key (must match server)
-    
-    string encrypt(const string &plaintext)
-    {
-        string result = plaintext;
-        for (size_t i = 0; i < result.length(); ++i)
-        {
-            result[i] ^= KEY[i % KEY.length()];
-        }
-        return result;
-    }
-    
-    string decrypt(const string &ciphertext)
-    {
-        return encrypt(ciphertext); // XOR is symmetric
-    }
-}
-
 static const char* CLR_RESET = "\033[0m";
 static const char* CLR_INFO  = "\033[36m"; // cyan
 static const char* CLR_WARN  = "\033[33m"; // yellow
@@ -58,11 +48,56 @@ static void printPrompt(const string& prompt) {
     cout << CLR_ME << prompt << CLR_RESET << flush;
 }
 
+static bool sendAll(int sock, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(sock, data.data() + sent, data.size() - sent, 0);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+static void printMessage(string line, const string& promptLabel) {
+    // Remove trailing newlines/carriage returns from the decrypted message
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+        line.pop_back();
+    }
+    
+    // Clear current line and move to new line before printing message
+    cout << "\r\033[K";
+    
+    // Enhanced color heuristics with better formatting
+    if (line.find("[SERVER]") != string::npos) {
+        cout << CLR_INFO << "┃ " << line << CLR_RESET << endl;
+    } else if (line.find("[PM from ") != string::npos) {
+        cout << CLR_PM << "✉ " << line << CLR_RESET << endl;
+    } else if (line.find("joined") != string::npos) {
+        cout << CLR_INFO << "→ " << line << CLR_RESET << endl;
+    } else if (line.find("left") != string::npos) {
+        cout << CLR_WARN << "← " << line << CLR_RESET << endl;
+    } else if (line.find("Rate limit") != string::npos || line.find("blocked") != string::npos) {
+        cout << CLR_ERR << "⚠ " << line << CLR_RESET << endl;
+    } else if (line.find("Blocked user") != string::npos || line.find("Unblocked") != string::npos) {
+        cout << CLR_WARN << "🚫 " << line << CLR_RESET << endl;
+    } else if (line.find("pinned") != string::npos) {
+        cout << CLR_INFO << "📌 " << line << CLR_RESET << endl;
+    } else if (line.find("Usage:") != string::npos || line.find("Commands:") != string::npos) {
+        cout << CLR_WARN << line << CLR_RESET << endl;
+    } else {
+        cout << line << endl;
+    }
+    // Repaint prompt
+    printPrompt(promptLabel);
+}
+
 void receiveMessages(int sock, const string promptLabel) {
-    char buffer[1024];
+    Framing::RingBuffer inbox;
+    string scratch;
     while (true) {
-        memset(buffer, 0, sizeof(buffer));
-        ssize_t bytes = recv(sock, buffer, sizeof(buffer) - 1, 0);
+        iovec iov[2];
+        int segments = inbox.writableSegments(iov);
+        ssize_t bytes = readv(sock, iov, segments);
         if (bytes <= 0) {
             cout << "\r\033[K" << CLR_ERR << "╔═══════════════════════════════╗\n";
             cout << "║ Disconnected from server      ║\n";
@@ -71,50 +106,521 @@ void receiveMessages(int sock, const string promptLabel) {
             g_running = false;
             return;
         }
-        
-        // Decrypt message
-        string encrypted(buffer, bytes);
-        string line = Encryption::decrypt(encrypted);
-        
-        // Remove trailing newlines/carriage returns from the decrypted message
-        while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
-            line.pop_back();
+        inbox.commit(bytes);
+
+        // One frame is one message, however TCP split or merged the reads
+        Framing::Frame frame;
+        Framing::ParseStatus status;
+        while ((status = Framing::nextFrame(inbox, scratch, frame, Framing::MAX_SERVER_PAYLOAD)) == Framing::ParseStatus::Complete) {
+            Encryption::applyInPlace(frame.payload, frame.length);
+            string line(frame.payload, frame.length);
+            inbox.consume(frame.size);
+            printMessage(line, promptLabel);
         }
-        
-        // Clear current line and move to new line before printing message
-        cout << "\r\033[K";
-        
-        // Enhanced color heuristics with better formatting
-        if (line.find("[SERVER]") != string::npos) {
-            cout << CLR_INFO << "┃ " << line << CLR_RESET << endl;
-        } else if (line.find("[PM from ") != string::npos) {
-            cout << CLR_PM << "✉ " << line << CLR_RESET << endl;
-        } else if (line.find("joined") != string::npos) {
-            cout << CLR_INFO << "→ " << line << CLR_RESET << endl;
-        } else if (line.find("left") != string::npos) {
-            cout << CLR_WARN << "← " << line << CLR_RESET << endl;
-        } else if (line.find("Rate limit") != string::npos || line.find("blocked") != string::npos) {
-            cout << CLR_ERR << "⚠ " << line << CLR_RESET << endl;
-        } else if (line.find("Blocked user") != string::npos || line.find("Unblocked") != string::npos) {
-            cout << CLR_WARN << "🚫 " << line << CLR_RESET << endl;
-        } else if (line.find("pinned") != string::npos) {
-            cout << CLR_INFO << "📌 " << line << CLR_RESET << endl;
-        } else if (line.find("Usage:") != string::npos || line.find("Commands:") != string::npos) {
-            cout << CLR_WARN << line << CLR_RESET << endl;
-        } else {
-            cout << line << endl;
+        if (status == Framing::ParseStatus::Invalid) {
+            cout << "\r\033[K" << CLR_ERR << "Protocol error from server." << CLR_RESET << endl;
+            close(sock);
+            g_running = false;
+            return;
         }
-        // Repaint prompt
-        printPrompt(promptLabel);
     }
 }
 
+// ---------------------------------------------------------------------------
+// Headless load generator (--load)
+//
+// One thread drives every connection through a single edge-triggered epoll
+// set. Each chat line carries "LOAD <run> <send time>", and every recipient
+// records how long the line took to reach it, so the percentiles describe
+// the whole fan-out, not just the server's accept of the message.
+// ---------------------------------------------------------------------------
+
+struct LoadOptions {
+    int connections = 1000;
+    int senders = 0;                 // connections that send, 0 = all of them
+    int rooms = 10;
+    string distribution = "uniform"; // uniform or zipf
+    double rate = 100;               // messages per second across all senders
+    double duration = 10;            // seconds of sending
+    double settle = 2;               // seconds between the last connect and the first message
+    size_t messageSize = 64;         // chat line length, marker included
+    bool json = false;
+};
+
+static int64_t nowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear histogram: exact below 64 ns, then 64 buckets per power of two (under 2% error)
+class LatencyHistogram {
+public:
+    LatencyHistogram() : buckets(64 + 58 * 64, 0) {}
+
+    void record(int64_t ns) {
+        if (ns < 0) ns = 0;
+        buckets[bucketFor(static_cast<uint64_t>(ns))]++;
+        total++;
+        if (ns > maxNs) maxNs = ns;
+    }
+
+    uint64_t count() const { return total; }
+    int64_t max() const { return maxNs; }
+
+    // Midpoint of the bucket holding the p-th fraction of samples
+    int64_t percentile(double p) const {
+        if (total == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(p * (total - 1)) + 1, seen = 0;
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            seen += buckets[i];
+            if (seen >= rank) return min(midpoint(i), maxNs);
+        }
+        return maxNs;
+    }
+
+private:
+    vector<uint64_t> buckets;
+    uint64_t total = 0;
+    int64_t maxNs = 0;
+
+    static size_t bucketFor(uint64_t v) {
+        if (v < 64) return v;
+        int exponent = 63 - __builtin_clzll(v);
+        int shift = exponent - 6;
+        return 64 + shift * 64 + ((v >> shift) - 64);
+    }
+
+    static int64_t midpoint(size_t i) {
+        if (i < 64) return i;
+        size_t shift = (i - 64) / 64;
+        uint64_t low = ((i - 64) % 64 + 64) << shift;
+        return low + (uint64_t(1) << shift) / 2;
+    }
+};
+
+struct LoadConn {
+    enum class State { Connecting, Open, Closed };
+    int fd = -1;
+    int room = 0;
+    State state = State::Connecting;
+    Framing::RingBuffer inbox;
+    string outbuf;          // bytes the socket has not taken yet
+    size_t outHead = 0;
+};
+
+struct LoadStats {
+    uint64_t connected = 0;
+    uint64_t connectFailed = 0;
+    uint64_t rejected = 0;      // username taken
+    uint64_t disconnected = 0;  // server closed a connection mid-run
+    uint64_t protocolErrors = 0;
+    uint64_t sendErrors = 0;
+    uint64_t sendStalls = 0;    // messages that had to wait for the socket
+    uint64_t rateLimited = 0;   // rate limit or slowmode warnings
+    uint64_t sent = 0;
+    uint64_t expected = 0;      // deliveries the sends should cause
+    uint64_t delivered = 0;
+    int64_t lastDelivery = 0;
+    LatencyHistogram latency;
+};
+
+static bool parseLoadOption(const string& arg, LoadOptions& opt) {
+    auto value = [&](const char* name) -> const char* {
+        size_t len = strlen(name);
+        return arg.compare(0, len, name) == 0 ? arg.c_str() + len : nullptr;
+    };
+    try {
+        const char* v;
+        if ((v = value("--connections="))) opt.connections = stoi(v);
+        else if ((v = value("--senders="))) opt.senders = stoi(v);
+        else if ((v = value("--rooms="))) opt.rooms = stoi(v);
+        else if ((v = value("--distribution="))) opt.distribution = v;
+        else if ((v = value("--rate="))) opt.rate = stod(v);
+        else if ((v = value("--duration="))) opt.duration = stod(v);
+        else if ((v = value("--settle="))) opt.settle = stod(v);
+        else if ((v = value("--size="))) opt.messageSize = stoul(v);
+        else if (arg == "--json") opt.json = true;
+        else return false;
+    } catch (const exception&) {
+        return false;
+    }
+    return true;
+}
+
+// Room of every connection; zipf puts room k's share at 1/(k+1)
+static vector<int> assignRooms(const LoadOptions& opt) {
+    vector<int> rooms(opt.connections);
+    if (opt.distribution == "zipf") {
+        vector<double> weights;
+        for (int k = 0; k < opt.rooms; ++k) weights.push_back(1.0 / (k + 1));
+        mt19937 rng(42); // the same layout every run
+        discrete_distribution<int> pick(weights.begin(), weights.end());
+        for (int& r : rooms) r = pick(rng);
+    } else {
+        for (int i = 0; i < opt.connections; ++i) rooms[i] = i % opt.rooms;
+    }
+    return rooms;
+}
+
+static void raiseFdLimit() {
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+class LoadGenerator {
+public:
+    LoadGenerator(const sockaddr_in& addr, const LoadOptions& options)
+        : server(addr), opt(options), conns(options.connections), roomMembers(options.rooms, 0) {
+        runId = to_string(getpid()) + "-" + to_string(nowNs() % 100000);
+        marker = "LOAD " + runId + " ";
+        vector<int> rooms = assignRooms(opt);
+        for (int i = 0; i < opt.connections; ++i) conns[i].room = rooms[i];
+        int senderCount = opt.senders > 0 ? min(opt.senders, opt.connections) : opt.connections;
+        for (int i = 0; i < senderCount; ++i) senders.push_back(i);
+    }
+
+    ~LoadGenerator() {
+        for (auto& c : conns)
+            if (c.fd >= 0) close(c.fd);
+        if (epollFd >= 0) close(epollFd);
+    }
+
+    bool run() {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0) {
+            cerr << CLR_ERR << "epoll_create1 failed: " << strerror(errno) << CLR_RESET << endl;
+            return false;
+        }
+        double perSender = opt.rate / senders.size();
+        if (perSender > 3)
+            cerr << CLR_WARN << "Each sender sends " << perSender << " msg/s; start the server with --rate=0 "
+                 << "or raise --rate to match, or most sends will be rate limited." << CLR_RESET << endl;
+
+        // Connect in waves so the listen backlog never overflows
+        int64_t lastStatus = nowNs();
+        int next = 0, pending = 0;
+        while (next < opt.connections || pending > 0) {
+            while (next < opt.connections && pending < MAX_PENDING_CONNECTS) {
+                if (openConnection(next++)) pending++;
+            }
+            pending -= poll(10);
+            if (nowNs() - lastStatus > 1000000000LL) {
+                lastStatus = nowNs();
+                cerr << "connecting: " << stats.connected << "/" << opt.connections << endl;
+            }
+        }
+        cerr << CLR_INFO << stats.connected << " connected, " << stats.connectFailed << " failed; settling for "
+             << opt.settle << "s" << CLR_RESET << endl;
+        pollFor(static_cast<int64_t>(opt.settle * 1e9));
+
+        // Sends are spread evenly over the run rather than in bursts
+        start = nowNs();
+        int64_t end = start + static_cast<int64_t>(opt.duration * 1e9);
+        size_t turn = 0;
+        lastStatus = start;
+        for (int64_t now = start; now < end; now = nowNs()) {
+            uint64_t due = static_cast<uint64_t>((now - start) * 1e-9 * opt.rate);
+            for (size_t tries = 0; stats.sent < due && tries < senders.size(); ++tries) {
+                LoadConn& c = conns[senders[turn++ % senders.size()]];
+                if (c.state == LoadConn::State::Open) sendChat(c, now);
+            }
+            poll(1);
+            if (now - lastStatus > 1000000000LL) {
+                lastStatus = now;
+                cerr << "t=" << (now - start) / 1000000000 << "s sent=" << stats.sent << " delivered=" << stats.delivered
+                     << " p99=" << stats.latency.percentile(0.99) / 1e6 << "ms" << endl;
+            }
+        }
+        sendingNs = nowNs() - start;
+
+        // Lets the last messages arrive before counting what was lost
+        int64_t drainEnd = nowNs() + 2000000000LL;
+        while (stats.delivered < stats.expected && nowNs() < drainEnd) poll(10);
+        return true;
+    }
+
+    void report() const {
+        const LatencyHistogram& l = stats.latency;
+        double sendSecs = sendingNs / 1e9;
+        double deliverSecs = stats.lastDelivery > start ? (stats.lastDelivery - start) / 1e9 : sendSecs;
+        double sendRate = sendSecs > 0 ? stats.sent / sendSecs : 0;
+        double deliverRate = deliverSecs > 0 ? stats.delivered / deliverSecs : 0;
+        auto ms = [](int64_t ns) { return ns / 1e6; };
+        if (opt.json) {
+            printf("{\"connections\":%d,\"connected\":%llu,\"rooms\":%d,\"distribution\":\"%s\",\"senders\":%zu,"
+                   "\"target_rate\":%.1f,\"sent\":%llu,\"send_rate\":%.1f,\"expected\":%llu,\"delivered\":%llu,"
+                   "\"delivery_rate\":%.1f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f,"
+                   "\"connect_failed\":%llu,\"rejected\":%llu,\"disconnected\":%llu,\"protocol_errors\":%llu,"
+                   "\"send_errors\":%llu,\"send_stalls\":%llu,\"rate_limited\":%llu}\n",
+                   opt.connections, (unsigned long long)stats.connected, opt.rooms, opt.distribution.c_str(),
+                   senders.size(), opt.rate, (unsigned long long)stats.sent, sendRate,
+                   (unsigned long long)stats.expected, (unsigned long long)stats.delivered, deliverRate,
+                   ms(l.percentile(0.5)), ms(l.percentile(0.99)), ms(l.percentile(0.999)), ms(l.max()),
+                   (unsigned long long)stats.connectFailed, (unsigned long long)stats.rejected,
+                   (unsigned long long)stats.disconnected, (unsigned long long)stats.protocolErrors,
+                   (unsigned long long)stats.sendErrors, (unsigned long long)stats.sendStalls,
+                   (unsigned long long)stats.rateLimited);
+            return;
+        }
+        printf("%s\nLoad run %s%s\n", CLR_INFO, runId.c_str(), CLR_RESET);
+        printf("  connections   %llu of %d (%d rooms, %s), %zu senders\n", (unsigned long long)stats.connected,
+               opt.connections, opt.rooms, opt.distribution.c_str(), senders.size());
+        printf("  sent          %llu in %.1fs (%.1f msg/s, target %.1f)\n", (unsigned long long)stats.sent, sendSecs,
+               sendRate, opt.rate);
+        printf("  delivered     %llu of %llu expected (%.1f msg/s)\n", (unsigned long long)stats.delivered,
+               (unsigned long long)stats.expected, deliverRate);
+        printf("  latency       p50 %.3fms  p99 %.3fms  p999 %.3fms  max %.3fms\n", ms(l.percentile(0.5)),
+               ms(l.percentile(0.99)), ms(l.percentile(0.999)), ms(l.max()));
+        printf("  errors        connect %llu, rejected %llu, disconnected %llu, protocol %llu, send %llu, "
+               "rate limited %llu\n", (unsigned long long)stats.connectFailed, (unsigned long long)stats.rejected,
+               (unsigned long long)stats.disconnected, (unsigned long long)stats.protocolErrors,
+               (unsigned long long)stats.sendErrors, (unsigned long long)stats.rateLimited);
+        printf("  send stalls   %llu\n", (unsigned long long)stats.sendStalls);
+    }
+
+    bool healthy() const {
+        return stats.connected > 0;
+    }
+
+private:
+    static constexpr int MAX_PENDING_CONNECTS = 256;
+
+    sockaddr_in server;
+    LoadOptions opt;
+    vector<LoadConn> conns;
+    vector<int> roomMembers; // open connections per room
+    vector<int> senders;
+    string runId;
+    string marker;           // "LOAD <run> ", so replays of earlier runs are ignored
+    int epollFd = -1;
+    int64_t start = 0;
+    int64_t sendingNs = 0;
+    LoadStats stats;
+    string scratch;
+
+    bool openConnection(int i) {
+        LoadConn& c = conns[i];
+        c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (c.fd < 0) {
+            stats.connectFailed++;
+            c.state = LoadConn::State::Closed;
+            return false;
+        }
+        if (connect(c.fd, (const sockaddr*)&server, sizeof(server)) < 0 && errno != EINPROGRESS) {
+            fail(c, stats.connectFailed);
+            return false;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+        ev.data.u32 = static_cast<uint32_t>(i);
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, c.fd, &ev);
+        return true;
+    }
+
+    void fail(LoadConn& c, uint64_t& counter) {
+        if (c.state == LoadConn::State::Closed) return;
+        if (c.state == LoadConn::State::Open) roomMembers[c.room]--;
+        c.state = LoadConn::State::Closed;
+        counter++;
+        close(c.fd);
+        c.fd = -1;
+        c.outbuf.clear();
+    }
+
+    // Waits up to timeoutMs for events and handles them; returns how many connects finished
+    int poll(int timeoutMs) {
+        epoll_event events[256];
+        int n = epoll_wait(epollFd, events, 256, timeoutMs);
+        int finished = 0;
+        for (int i = 0; i < n; ++i) {
+            LoadConn& c = conns[events[i].data.u32];
+            if (c.state == LoadConn::State::Connecting) {
+                finished++;
+                if (!finishConnect(c, static_cast<int>(events[i].data.u32))) continue;
+            }
+            if (c.state != LoadConn::State::Open) continue;
+            if (events[i].events & EPOLLOUT) flush(c);
+            if (c.state == LoadConn::State::Open && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)))
+                receive(c);
+        }
+        return finished;
+    }
+
+    void pollFor(int64_t ns) {
+        for (int64_t until = nowNs() + ns; nowNs() < until;) poll(10);
+    }
+
+    bool finishConnect(LoadConn& c, int index) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            fail(c, stats.connectFailed);
+            return false;
+        }
+        c.state = LoadConn::State::Open;
+        stats.connected++;
+        roomMembers[c.room]++;
+        string name = "load" + runId + "_" + to_string(index);
+        queue(c, Framing::preamble() + Framing::encode(Framing::FrameType::Hello, name) +
+                     Framing::encode(Framing::FrameType::Text, "/join load" + to_string(c.room)));
+        return c.state == LoadConn::State::Open;
+    }
+
+    void sendChat(LoadConn& c, int64_t now) {
+        string line = marker + to_string(now) + " ";
+        if (line.size() < opt.messageSize) line.append(opt.messageSize - line.size(), 'x');
+        stats.sent++;
+        stats.expected += roomMembers[c.room] - 1; // the server does not echo to the sender
+        if (!c.outbuf.empty()) stats.sendStalls++;
+        queue(c, Framing::encode(Framing::FrameType::Text, line));
+    }
+
+    void queue(LoadConn& c, const string& bytes) {
+        c.outbuf += bytes;
+        flush(c);
+    }
+
+    void flush(LoadConn& c) {
+        while (c.outHead < c.outbuf.size()) {
+            ssize_t n = send(c.fd, c.outbuf.data() + c.outHead, c.outbuf.size() - c.outHead, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return; // resumes on EPOLLOUT
+            if (n <= 0) {
+                fail(c, stats.sendErrors);
+                return;
+            }
+            c.outHead += n;
+        }
+        c.outbuf.clear();
+        c.outHead = 0;
+    }
+
+    void receive(LoadConn& c) {
+        while (true) {
+            iovec iov[2];
+            int segments = c.inbox.writableSegments(iov);
+            ssize_t bytes = readv(c.fd, iov, segments);
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (bytes <= 0) {
+                fail(c, stats.disconnected);
+                return;
+            }
+            c.inbox.commit(bytes);
+
+            Framing::Frame frame;
+            Framing::ParseStatus status;
+            while ((status = Framing::nextFrame(c.inbox, scratch, frame, Framing::MAX_SERVER_PAYLOAD)) ==
+                   Framing::ParseStatus::Complete) {
+                Encryption::applyInPlace(frame.payload, frame.length);
+                handleLine(string_view(frame.payload, frame.length));
+                c.inbox.consume(frame.size);
+            }
+            if (status == Framing::ParseStatus::Invalid) {
+                fail(c, stats.protocolErrors);
+                return;
+            }
+        }
+    }
+
+    void handleLine(string_view line) {
+        size_t at = line.find(marker);
+        if (at != string_view::npos) {
+            int64_t now = nowNs();
+            int64_t sentAt = strtoll(line.data() + at + marker.size(), nullptr, 10);
+            stats.latency.record(now - sentAt);
+            stats.delivered++;
+            stats.lastDelivery = now;
+        } else if (line.find("Rate limit exceeded") != string_view::npos || line.find("Slowmode is on") != string_view::npos) {
+            stats.rateLimited++;
+        } else if (line.find("is already taken") != string_view::npos) {
+            stats.rejected++;
+        }
+    }
+};
+
+static void printUsage() {
+    cerr << "Usage: ./client [server_ip] <port>\n"
+         << "Example (local): ./client 8080\n"
+         << "Example (remote): ./client 192.168.1.105 8080\n"
+         << "Load test: ./client --load [options] [server_ip] <port> (see ./client --load --help)" << endl;
+}
+
+static void printLoadUsage() {
+    cerr << "Usage: ./client --load [options] [server_ip] <port>\n"
+         << "  --connections=N       Connections to open (default 1000)\n"
+         << "  --senders=N           How many of them send, 0 = all (default 0)\n"
+         << "  --rooms=N             Rooms to spread them over (default 10)\n"
+         << "  --distribution=D      uniform or zipf (room k gets a 1/(k+1) share) (default uniform)\n"
+         << "  --rate=N              Messages per second across all senders (default 100)\n"
+         << "  --duration=SECONDS    How long to send (default 10)\n"
+         << "  --settle=SECONDS      Pause between connecting and sending (default 2)\n"
+         << "  --size=BYTES          Chat line length (default 64)\n"
+         << "  --json                Print the report as one JSON object" << endl;
+}
+
+static int runLoad(const string& serverIp, int port, const LoadOptions& opt) {
+    if (opt.connections < 1 || opt.rooms < 1 || opt.rate <= 0 || opt.duration <= 0 || opt.settle < 0 ||
+        (opt.distribution != "uniform" && opt.distribution != "zipf")) {
+        printLoadUsage();
+        return 1;
+    }
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, serverIp.c_str(), &addr.sin_addr) != 1) {
+        cerr << "Error: Invalid server address " << serverIp << endl;
+        return 1;
+    }
+    raiseFdLimit();
+
+    LoadGenerator load(addr, opt);
+    if (!load.run()) return 1;
+    load.report();
+    return load.healthy() ? 0 : 1;
+}
+
 int main(int argc, char* argv[]) {
     signal(SIGPIPE, SIG_IGN);
-    if (argc != 2 && argc != 3) {
-        cerr << "Usage: ./client [server_ip] <port>" << endl;
-        cerr << "Example (local): ./client 8080" << endl;
-        cerr << "Example (remote): ./client 192.168.1.105 8080" << endl;
+
+    // Options may come anywhere; what is left is [server_ip] <port>
+    bool loadMode = false;
+    bool help = false;
+    LoadOptions loadOptions;
+    vector<string> positional;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--load") {
+            loadMode = true;
+        } else if (arg == "--help") {
+            help = true;
+        } else if (arg.rfind("--", 0) == 0) {
+            if (!parseLoadOption(arg, loadOptions)) {
+                cerr << "Unknown option: " << arg << endl;
+                printLoadUsage();
+                return 1;
+            }
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    // --help alone is about the chat client; the load options need --load --help
+    if (help) {
+        if (loadMode) printLoadUsage();
+        else printUsage();
+        return 0;
+    }
+
+    if (!loadMode && positional.size() + 1 < static_cast<size_t>(argc)) {
+        cerr << "Options other than --load need --load." << endl;
+        return 1;
+    }
+
+    if (positional.size() != 1 && positional.size() != 2) {
+        printUsage();
         return 1;
     }
 
@@ -123,11 +629,11 @@ int main(int argc, char* argv[]) {
     int port;
 
     try {
-        if (argc == 2) {
-            port = stoi(argv[1]);
+        if (positional.size() == 1) {
+            port = stoi(positional[0]);
         } else {
-            serverIp = argv[1];
-            port = stoi(argv[2]);
+            serverIp = positional[0];
+            port = stoi(positional[1]);
         }
         
         if (port < 1 || port > 65535) {
@@ -139,6 +645,8 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (loadMode) return runLoad(serverIp, port, loadOptions);
+
     printBanner();
 
     int sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -170,7 +678,12 @@ int main(int argc, char* argv[]) {
         cout << "Warning: Username truncated to 63 characters" << endl;
     }
     
-    send(sock, username.c_str(), username.size(), 0);
+    // Preamble and Hello frame go out together; the server answers in frames
+    if (!sendAll(sock, Framing::preamble() + Framing::encode(Framing::FrameType::Hello, username))) {
+        cerr << "Connection failed to " << serverIp << ":" << port << endl;
+        close(sock);
+        return 1;
+    }
 
     cout << "Connected to server (" << serverIp << ":" << port << ") as " << username << endl;
     cout << "Type messages below. Use /quit to disconnect & /list to see people who are online." << endl;
@@ -201,10 +714,13 @@ int main(int argc, char* argv[]) {
 
         if (message.empty()) continue;
 
+        if (message.size() > Framing::MAX_PAYLOAD) {
+            cout << CLR_ERR << "Message too long (max " << Framing::MAX_PAYLOAD << " bytes)." << CLR_RESET << endl;
+            continue;
+        }
+
         // Encrypt message before sending
-        string encrypted = Encryption::encrypt(message);
-        ssize_t sent = send(sock, encrypted.c_str(), encrypted.size(), 0);
-        if (sent < 0) {
+        if (!sendAll(sock, Framing::encode(Framing::FrameType::Text, message))) {
             cerr << "Send failed." << endl;
             close(sock);
             return 1;
@@ -0,0 +1,358 @@
+#pragma once
+
+// Who is connected and which room each session is in.
+//
+// Sessions are kept in SHARDS socket-keyed maps with a mutex each, so
+// connects and disconnects on different cores rarely meet, plus a name index
+// sharded the same way that makes names unique and /pm or kick O(1). Neither
+// is read on the message path.
+//
+// Room membership is what every broadcast reads, so it is published for
+// lock-free readers: the room directory and each room's member list are
+// immutable versions behind atomic pointers, replaced copy-on-write under one
+// write mutex and freed through Epoch once no reader can still see them.
+// A member list is split into fixed chunks and a change copies only the chunk
+// it touches plus the chunk index, so joining a huge room stays cheap.
+//
+// Session must have `int socket`, `std::string name`, `std::string room` and
+// `size_t roomSlot`; name must not change while the session is registered.
+// room and roomSlot belong to the registry; a session's own thread may read
+// its room without locking because only that thread moves it (join/leave).
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "epoch.h"
+#include "tracing.h"
+
+template <typename Session>
+class ClientRegistry
+{
+    struct Members; // defined below, MemberView points at one
+
+public:
+    using Ptr = std::shared_ptr<Session>;
+
+    static constexpr size_t SHARDS = 16;
+    static constexpr size_t CHUNK = 256;          // members per chunk of a room's list
+    static constexpr size_t NO_SLOT = SIZE_MAX;   // roomSlot of a session outside any room
+
+    ClientRegistry() = default;
+    ClientRegistry(const ClientRegistry &) = delete;
+    ClientRegistry &operator=(const ClientRegistry &) = delete;
+
+    ~ClientRegistry()
+    {
+        for (auto &shard : directory)
+        {
+            const RoomMap *rooms = shard.load();
+            if (!rooms)
+                continue;
+            for (auto &entry : *rooms)
+                deleteRoom(entry.second);
+            delete rooms;
+        }
+    }
+
+    // False if another session already has the name
+    bool add(const Ptr &session)
+    {
+        NameShard &names = nameShardFor(session->name);
+        std::lock_guard<std::mutex> nameLock(names.mutex);
+        if (!names.sessions.emplace(session->name, session).second)
+            return false;
+        Shard &shard = shardFor(session->socket);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.sessions[session->socket] = session;
+        return true;
+    }
+
+    // False if it was already gone (kicked, or never registered)
+    bool erase(const Ptr &session)
+    {
+        NameShard &names = nameShardFor(session->name);
+        std::lock_guard<std::mutex> nameLock(names.mutex);
+        auto named = names.sessions.find(session->name);
+        if (named == names.sessions.end() || named->second != session)
+            return false;
+        names.sessions.erase(named);
+        Shard &shard = shardFor(session->socket);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.sessions.erase(session->socket);
+        return true;
+    }
+
+    Ptr findByName(const std::string &name)
+    {
+        NameShard &names = nameShardFor(name);
+        std::lock_guard<std::mutex> lock(names.mutex);
+        auto found = names.sessions.find(name);
+        return found == names.sessions.end() ? nullptr : found->second;
+    }
+
+    // Moves the session into `room`, leaving its current one; call from the session's own thread
+    void join(const Ptr &session, const std::string &room)
+    {
+        Trace::TimedLock<std::mutex> lock(writeMutex, "wait registry", "hold registry");
+        leaveLocked(session);
+        Room *target = findOrCreateLocked(room);
+        const Members *old = target->members.load();
+        Members *next = new Members(*old);
+        size_t slot = next->size++;
+        const Chunk *replaced = nullptr;
+        if (slot % CHUNK == 0)
+        {
+            Chunk *fresh = new Chunk;
+            fresh->slots[0] = session.get();
+            next->chunks.push_back(fresh);
+        }
+        else
+        {
+            Chunk *copy = new Chunk(*next->chunks.back());
+            copy->slots[slot % CHUNK] = session.get();
+            replaced = next->chunks.back();
+            next->chunks.back() = copy;
+        }
+        session->room = room;
+        session->roomSlot = slot;
+
+        // Retire only after publishing, or a reader could still find the old version
+        target->members.store(next);
+        Epoch::retireObject(old);
+        if (replaced)
+            Epoch::retireObject(replaced);
+    }
+
+    void leave(const Ptr &session)
+    {
+        Trace::TimedLock<std::mutex> lock(writeMutex, "wait registry", "hold registry");
+        leaveLocked(session);
+    }
+
+    // Lock-free: calls visit(Session *) for each member of the room. The
+    // pointers stay valid for the call even if the member leaves meanwhile.
+    template <typename Visit>
+    void forEachMember(const std::string &room, Visit &&visit) const
+    {
+        Epoch::Guard guard;
+        const Room *r = findRoom(room);
+        if (!r)
+            return;
+        const Members *members = r->members.load();
+        size_t remaining = members->size;
+        for (const Chunk *chunk : members->chunks)
+        {
+            size_t n = remaining < CHUNK ? remaining : CHUNK;
+            for (size_t i = 0; i < n; ++i)
+                visit(chunk->slots[i]);
+            remaining -= n;
+        }
+    }
+
+    // A room's member list as of the call, indexable so a fan-out can be split
+    // into ranges. Only valid while the caller holds an Epoch::Guard.
+    class MemberView
+    {
+    public:
+        size_t size() const
+        {
+            return members ? members->size : 0;
+        }
+
+        Session *operator[](size_t i) const
+        {
+            return members->chunks[i / CHUNK]->slots[i % CHUNK];
+        }
+
+    private:
+        friend class ClientRegistry;
+        const Members *members = nullptr;
+    };
+
+    MemberView members(const std::string &room) const
+    {
+        MemberView view;
+        if (const Room *r = findRoom(room))
+            view.members = r->members.load();
+        return view;
+    }
+
+    // Lock-free: calls visit(name, memberCount) for each non-empty room
+    template <typename Visit>
+    void forEachRoom(Visit &&visit) const
+    {
+        Epoch::Guard guard;
+        for (auto &shard : directory)
+        {
+            const RoomMap *rooms = shard.load();
+            if (!rooms)
+                continue;
+            for (auto &entry : *rooms)
+                visit(entry.first, entry.second->members.load()->size);
+        }
+    }
+
+    // Calls visit(const Ptr &) for every registered session, with membership
+    // frozen so session->room can be read. Rare commands only.
+    template <typename Visit>
+    void forEachSession(Visit &&visit)
+    {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        for (Shard &shard : shards)
+        {
+            std::lock_guard<std::mutex> shardLock(shard.mutex);
+            for (auto &entry : shard.sessions)
+                visit(entry.second);
+        }
+    }
+
+private:
+    struct Chunk
+    {
+        Session *slots[CHUNK];
+    };
+
+    // Immutable once published; consecutive versions share untouched chunks
+    struct Members
+    {
+        size_t size = 0;
+        std::vector<const Chunk *> chunks;
+    };
+
+    struct Room
+    {
+        std::atomic<const Members *> members{new Members};
+    };
+
+    using RoomMap = std::unordered_map<std::string, Room *>;
+
+    struct alignas(64) Shard
+    {
+        std::mutex mutex;
+        std::unordered_map<int, Ptr> sessions; // socket -> session
+    };
+
+    struct alignas(64) NameShard
+    {
+        std::mutex mutex; // taken before a Shard mutex, never after
+        std::unordered_map<std::string, Ptr> sessions; // name -> session
+    };
+
+    Shard shards[SHARDS];
+    NameShard nameShards[SHARDS];
+    std::atomic<const RoomMap *> directory[SHARDS] = {}; // by hash of the room name
+    std::mutex writeMutex;                               // serialises membership changes
+
+    Shard &shardFor(int socket)
+    {
+        return shards[static_cast<size_t>(socket) % SHARDS];
+    }
+
+    NameShard &nameShardFor(const std::string &name)
+    {
+        return nameShards[std::hash<std::string>()(name) % SHARDS];
+    }
+
+    static size_t directoryShard(const std::string &room)
+    {
+        return std::hash<std::string>()(room) % SHARDS;
+    }
+
+    const Room *findRoom(const std::string &room) const
+    {
+        const RoomMap *rooms = directory[directoryShard(room)].load();
+        if (!rooms)
+            return nullptr;
+        auto found = rooms->find(room);
+        return found == rooms->end() ? nullptr : found->second;
+    }
+
+    Room *findOrCreateLocked(const std::string &room)
+    {
+        auto &shard = directory[directoryShard(room)];
+        const RoomMap *rooms = shard.load();
+        if (rooms)
+        {
+            auto found = rooms->find(room);
+            if (found != rooms->end())
+                return found->second;
+        }
+        RoomMap *next = rooms ? new RoomMap(*rooms) : new RoomMap;
+        Room *created = new Room;
+        (*next)[room] = created;
+        shard.store(next);
+        if (rooms)
+            Epoch::retireObject(rooms);
+        return created;
+    }
+
+    // Swap-removes the session: the last member takes its slot
+    void leaveLocked(const Ptr &session)
+    {
+        if (session->roomSlot == NO_SLOT)
+            return;
+        auto &shard = directory[directoryShard(session->room)];
+        const RoomMap *rooms = shard.load();
+        Room *room = rooms->at(session->room);
+        const Members *old = room->members.load();
+        size_t slot = session->roomSlot;
+        size_t last = old->size - 1;
+        session->roomSlot = NO_SLOT;
+
+        if (last == 0)
+        {
+            // Last one out removes the room from the directory
+            RoomMap *next = new RoomMap(*rooms);
+            next->erase(session->room);
+            shard.store(next);
+            Epoch::retireObject(rooms);
+            Epoch::retire([room] { deleteRoom(room); });
+        }
+        else
+        {
+            Members *next = new Members(*old);
+            const Chunk *replaced = nullptr;
+            const Chunk *dropped = nullptr;
+            if (slot != last)
+            {
+                Session *moved = old->chunks[last / CHUNK]->slots[last % CHUNK];
+                Chunk *copy = new Chunk(*old->chunks[slot / CHUNK]);
+                copy->slots[slot % CHUNK] = moved;
+                replaced = old->chunks[slot / CHUNK];
+                next->chunks[slot / CHUNK] = copy;
+                moved->roomSlot = slot;
+            }
+            if (last % CHUNK == 0)
+            {
+                dropped = next->chunks.back();
+                next->chunks.pop_back();
+            }
+            next->size = last;
+            room->members.store(next);
+            Epoch::retireObject(old);
+            if (replaced)
+                Epoch::retireObject(replaced);
+            if (dropped)
+                Epoch::retireObject(dropped);
+        }
+
+        // Readers may still hold the old list; keep the session alive for them
+        Ptr keepAlive = session;
+        Epoch::retire([keepAlive] {});
+    }
+
+    static void deleteRoom(Room *room)
+    {
+        const Members *members = room->members.load();
+        for (const Chunk *chunk : members->chunks)
+            delete chunk;
+        delete members;
+        delete room;
+    }
+};
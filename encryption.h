@@ -0,0 +1,192 @@
+#pragma once
+
+// XOR cipher shared by the server and the client.
+//
+// Every packet is XORed with the repeating KEY starting at key position 0.
+// The key is expanded once into a stream long enough that any 64-byte window,
+// starting at any key position, is contiguous; the kernels then XOR whole
+// blocks and only advance the window position once per block, so the per-byte
+// modulo of the original loop is gone. The widest kernel the CPU supports is
+// picked once at startup.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OPTICOM_XOR_X86 1
+#endif
+
+namespace Encryption
+{
+    const std::string KEY = "OpticomSecureKey2025"; // Shared key
+
+    struct KeyStream
+    {
+        static constexpr size_t BLOCK = 64;
+        size_t period;                     // key length
+        size_t step;                       // BLOCK % period, how far a block moves the window
+        std::vector<unsigned char> bytes;  // key repeated to period + BLOCK bytes
+
+        explicit KeyStream(const std::string &key) : period(key.size()), step(BLOCK % key.size())
+        {
+            bytes.resize(period + BLOCK);
+            for (size_t i = 0; i < bytes.size(); ++i)
+                bytes[i] = static_cast<unsigned char>(key[i % period]);
+        }
+
+        size_t advance(size_t offset) const
+        {
+            offset += step;
+            return offset >= period ? offset - period : offset;
+        }
+    };
+
+    inline const KeyStream &keyStream()
+    {
+        static const KeyStream stream(KEY);
+        return stream;
+    }
+
+    // data[0] is XORed with key position `offset` (< KEY.size())
+    using XorKernel = void (*)(unsigned char *data, size_t len, size_t offset);
+
+    namespace detail
+    {
+        // Tail shorter than one block: the window is still contiguous
+        inline void xorTail(unsigned char *data, size_t len, const unsigned char *key)
+        {
+            for (size_t i = 0; i < len; ++i)
+                data[i] ^= key[i];
+        }
+
+        inline void xorScalar(unsigned char *data, size_t len, size_t offset)
+        {
+            const KeyStream &ks = keyStream();
+            while (len >= KeyStream::BLOCK)
+            {
+                const unsigned char *key = ks.bytes.data() + offset;
+                for (size_t i = 0; i < KeyStream::BLOCK; ++i)
+                    data[i] ^= key[i];
+                data += KeyStream::BLOCK;
+                len -= KeyStream::BLOCK;
+                offset = ks.advance(offset);
+            }
+            xorTail(data, len, ks.bytes.data() + offset);
+        }
+
+#ifdef OPTICOM_XOR_X86
+        __attribute__((target("sse2"))) inline void xorSse2(unsigned char *data, size_t len, size_t offset)
+        {
+            const KeyStream &ks = keyStream();
+            while (len >= KeyStream::BLOCK)
+            {
+                const unsigned char *key = ks.bytes.data() + offset;
+                for (size_t i = 0; i < KeyStream::BLOCK; i += 16)
+                {
+                    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+                    __m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i *>(key + i));
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(data + i), _mm_xor_si128(d, k));
+                }
+                data += KeyStream::BLOCK;
+                len -= KeyStream::BLOCK;
+                offset = ks.advance(offset);
+            }
+            xorTail(data, len, ks.bytes.data() + offset);
+        }
+
+        __attribute__((target("avx2"))) inline void xorAvx2(unsigned char *data, size_t len, size_t offset)
+        {
+            const KeyStream &ks = keyStream();
+            while (len >= KeyStream::BLOCK)
+            {
+                const unsigned char *key = ks.bytes.data() + offset;
+                __m256i d0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+                __m256i d1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 32));
+                __m256i k0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(key));
+                __m256i k1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(key + 32));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(data), _mm256_xor_si256(d0, k0));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(data + 32), _mm256_xor_si256(d1, k1));
+                data += KeyStream::BLOCK;
+                len -= KeyStream::BLOCK;
+                offset = ks.advance(offset);
+            }
+            xorTail(data, len, ks.bytes.data() + offset);
+        }
+
+        __attribute__((target("avx512f,avx512bw"))) inline void xorAvx512(unsigned char *data, size_t len, size_t offset)
+        {
+            const KeyStream &ks = keyStream();
+            while (len >= KeyStream::BLOCK)
+            {
+                const unsigned char *key = ks.bytes.data() + offset;
+                __m512i d = _mm512_loadu_si512(data);
+                __m512i k = _mm512_loadu_si512(key);
+                _mm512_storeu_si512(data, _mm512_xor_si512(d, k));
+                data += KeyStream::BLOCK;
+                len -= KeyStream::BLOCK;
+                offset = ks.advance(offset);
+            }
+            if (len > 0)
+            {
+                // Masked loads/stores finish the tail without touching bytes past the end
+                __mmask64 mask = (~0ULL) >> (KeyStream::BLOCK - len);
+                __m512i d = _mm512_maskz_loadu_epi8(mask, data);
+                __m512i k = _mm512_maskz_loadu_epi8(mask, ks.bytes.data() + offset);
+                _mm512_mask_storeu_epi8(data, mask, _mm512_xor_si512(d, k));
+            }
+        }
+#endif
+
+        struct KernelChoice
+        {
+            XorKernel kernel;
+            const char *name;
+        };
+
+        inline KernelChoice selectKernel()
+        {
+#ifdef OPTICOM_XOR_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+                return {xorAvx512, "avx512"};
+            if (__builtin_cpu_supports("avx2"))
+                return {xorAvx2, "avx2"};
+            if (__builtin_cpu_supports("sse2"))
+                return {xorSse2, "sse2"};
+#endif
+            return {xorScalar, "scalar"};
+        }
+
+        inline const KernelChoice &activeKernel()
+        {
+            static const KernelChoice choice = selectKernel();
+            return choice;
+        }
+    }
+
+    inline const char *kernelName()
+    {
+        return detail::activeKernel().name;
+    }
+
+    // Encrypts or decrypts len bytes in place; offset is the key position of data[0]
+    inline void applyInPlace(char *data, size_t len, size_t offset = 0)
+    {
+        detail::activeKernel().kernel(reinterpret_cast<unsigned char *>(data), len, offset % keyStream().period);
+    }
+
+    inline std::string encrypt(const std::string &plaintext)
+    {
+        std::string result = plaintext;
+        applyInPlace(&result[0], result.size());
+        return result;
+    }
+
+    inline std::string decrypt(const std::string &ciphertext)
+    {
+        return encrypt(ciphertext); // XOR is symmetric
+    }
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+// Epoch-based reclamation for read-mostly shared data.
+//
+// Readers wrap their lock-free reads in an Epoch::Guard, which only publishes
+// the current epoch in a per-thread slot. Writers copy, publish the new
+// version with an atomic store and retire() the old one; a retired object is
+// freed once every thread that might still be reading it has left its guard.
+// Freeing is batched, so the slot scan is amortised over many retirements.
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace Epoch
+{
+    namespace detail
+    {
+        struct alignas(64) Slot
+        {
+            std::atomic<uint64_t> epoch{0}; // 0 = not reading
+            std::atomic<bool> inUse{true};  // owned by a live thread
+            unsigned depth = 0;             // nested guards, owner thread only
+            Slot *next = nullptr;
+        };
+
+        struct Domain
+        {
+            static constexpr size_t RECLAIM_BATCH = 64;
+
+            std::atomic<uint64_t> global{1};
+            std::atomic<Slot *> slots{nullptr}; // never shrinks; slots of finished threads are reused
+            std::mutex retireMutex;
+            std::vector<std::pair<uint64_t, std::function<void()>>> retired;
+        };
+
+        // Deliberately leaked so threads still running at exit never touch a dead domain
+        inline Domain &domain()
+        {
+            static Domain *instance = new Domain;
+            return *instance;
+        }
+
+        inline Slot *acquireSlot()
+        {
+            Domain &d = domain();
+            for (Slot *s = d.slots.load(); s; s = s->next)
+            {
+                bool expected = false;
+                if (!s->inUse.load(std::memory_order_relaxed) && s->inUse.compare_exchange_strong(expected, true))
+                    return s;
+            }
+            Slot *s = new Slot;
+            s->next = d.slots.load();
+            while (!d.slots.compare_exchange_weak(s->next, s))
+            {
+            }
+            return s;
+        }
+
+        struct SlotHolder
+        {
+            Slot *slot = nullptr;
+            ~SlotHolder()
+            {
+                if (slot)
+                    slot->inUse.store(false);
+            }
+        };
+
+        inline Slot *localSlot()
+        {
+            thread_local SlotHolder holder;
+            if (!holder.slot)
+                holder.slot = acquireSlot();
+            return holder.slot;
+        }
+
+        // Runs the deleters no reader can still reach; called with retireMutex held,
+        // returns them so they run after the lock is released
+        inline std::vector<std::function<void()>> collectLocked(Domain &d)
+        {
+            uint64_t oldestReader = UINT64_MAX;
+            for (Slot *s = d.slots.load(); s; s = s->next)
+            {
+                uint64_t e = s->epoch.load();
+                if (e != 0 && e < oldestReader)
+                    oldestReader = e;
+            }
+            std::vector<std::function<void()>> ready;
+            size_t kept = 0;
+            for (auto &entry : d.retired)
+            {
+                if (entry.first < oldestReader)
+                    ready.push_back(std::move(entry.second));
+                else
+                    d.retired[kept++] = std::move(entry);
+            }
+            d.retired.resize(kept);
+            return ready;
+        }
+    }
+
+    // Read-side critical section; nests, costs two stores to a thread-local slot
+    class Guard
+    {
+    public:
+        Guard() : slot(detail::localSlot())
+        {
+            if (slot->depth++ == 0)
+                slot->epoch.store(detail::domain().global.load());
+        }
+
+        ~Guard()
+        {
+            if (--slot->depth == 0)
+                slot->epoch.store(0, std::memory_order_release);
+        }
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+
+    private:
+        detail::Slot *slot;
+    };
+
+    // Runs deleter once no guard that could have seen the old data is still open.
+    // Call after the replacement has been published.
+    inline void retire(std::function<void()> deleter)
+    {
+        detail::Domain &d = detail::domain();
+        std::vector<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> lock(d.retireMutex);
+            d.retired.emplace_back(d.global.fetch_add(1), std::move(deleter));
+            if (d.retired.size() >= detail::Domain::RECLAIM_BATCH)
+                ready = detail::collectLocked(d);
+        }
+        for (auto &fn : ready)
+            fn();
+    }
+
+    template <typename T>
+    inline void retireObject(const T *object)
+    {
+        retire([object] { delete object; });
+    }
+
+    // An immutable T published through one atomic pointer: readers load() inside
+    // a Guard, writers update() a private copy that replaces the current one
+    template <typename T>
+    class RcuPtr
+    {
+    public:
+        RcuPtr() = default;
+
+        ~RcuPtr()
+        {
+            delete ptr.load(); // the owner outlived every reader
+        }
+
+        RcuPtr(const RcuPtr &) = delete;
+        RcuPtr &operator=(const RcuPtr &) = delete;
+
+        const T *load() const
+        {
+            return ptr.load();
+        }
+
+        template <typename Mutate>
+        void update(Mutate &&mutate)
+        {
+            std::lock_guard<std::mutex> lock(writeMutex);
+            const T *current = ptr.load();
+            T *next = current ? new T(*current) : new T();
+            mutate(*next);
+            ptr.store(next);
+            if (current)
+                retireObject(current);
+        }
+
+    private:
+        std::atomic<const T *> ptr{nullptr};
+        std::mutex writeMutex;
+    };
+}
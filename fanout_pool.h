@@ -0,0 +1,182 @@
+#pragma once
+
+// Work-stealing thread pool for splitting one big loop across cores.
+//
+// parallelFor() cuts its range in halves on the way down: whoever runs a
+// range larger than the grain keeps the lower half and pushes the upper half
+// onto its own deque, so the pieces waiting to be stolen are the biggest
+// ones and a few steals spread the whole range out like a tree. Owners pop
+// the newest piece from the back, thieves take the oldest from the front.
+// The calling thread works too and only returns once every index is done,
+// which lets the body use data the caller keeps alive on its stack.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class FanoutPool
+{
+public:
+    explicit FanoutPool(size_t threads) : queues(threads + 1) // the last deque takes outside callers' pieces
+    {
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back([this, i] { run(i); });
+    }
+
+    ~FanoutPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &t : workers)
+            t.join();
+    }
+
+    FanoutPool(const FanoutPool &) = delete;
+    FanoutPool &operator=(const FanoutPool &) = delete;
+
+    size_t threads() const
+    {
+        return workers.size();
+    }
+
+    // Calls body(lo, hi) for disjoint ranges covering [0, n), none longer
+    // than `grain`, on the pool and the calling thread
+    template <typename Body>
+    void parallelFor(size_t n, size_t grain, Body &body)
+    {
+        grain = std::max<size_t>(grain, 1);
+        if (workers.empty() || n <= grain)
+        {
+            body(size_t(0), n);
+            return;
+        }
+        Job job;
+        job.body = &body;
+        job.call = [](void *b, size_t lo, size_t hi) { (*static_cast<Body *>(b))(lo, hi); };
+        job.grain = grain;
+        job.remaining.store(n);
+
+        size_t home = queues.size() - 1;
+        execute(Task{&job, 0, n}, home);
+        // Help with whatever is queued until the last piece of this job is done
+        while (job.remaining.load(std::memory_order_acquire) > 0)
+        {
+            Task task;
+            if (take(home, task))
+                execute(task, home);
+            else
+                std::this_thread::yield();
+        }
+    }
+
+private:
+    struct Job
+    {
+        void *body;
+        void (*call)(void *, size_t, size_t);
+        size_t grain;
+        std::atomic<size_t> remaining; // indices not yet run; the caller's stack frame lives until 0
+    };
+
+    struct Task
+    {
+        Job *job = nullptr;
+        size_t lo = 0;
+        size_t hi = 0;
+    };
+
+    struct alignas(64) Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<Queue> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> queued{0};   // tasks across all deques
+    std::atomic<size_t> sleeping{0}; // workers waiting on `wake`
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    void push(size_t q, const Task &task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queues[q].mutex);
+            queues[q].tasks.push_back(task);
+        }
+        queued.fetch_add(1);
+        if (sleeping.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex); // a worker between its check and its wait sees the task
+            wake.notify_one();
+        }
+    }
+
+    // The newest piece of our own deque, else the oldest of somebody else's
+    bool take(size_t q, Task &task)
+    {
+        if (queued.load() == 0)
+            return false;
+        for (size_t k = 0; k < queues.size(); ++k)
+        {
+            Queue &victim = queues[(q + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.tasks.empty())
+                continue;
+            if (k == 0)
+            {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+            }
+            else
+            {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+            }
+            queued.fetch_sub(1);
+            return true;
+        }
+        return false;
+    }
+
+    void execute(Task task, size_t q)
+    {
+        while (task.hi - task.lo > task.job->grain)
+        {
+            size_t mid = task.lo + (task.hi - task.lo) / 2;
+            push(q, Task{task.job, mid, task.hi});
+            task.hi = mid;
+        }
+        Job *job = task.job;
+        job->call(job->body, task.lo, task.hi);
+        job->remaining.fetch_sub(task.hi - task.lo, std::memory_order_acq_rel); // job may be gone after this
+    }
+
+    void run(size_t q)
+    {
+        while (true)
+        {
+            Task task;
+            if (take(q, task))
+            {
+                execute(task, q);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleeping.fetch_add(1);
+            wake.wait(lock, [this] { return stopping || queued.load() > 0; });
+            sleeping.fetch_sub(1);
+            if (stopping)
+                return;
+        }
+    }
+};
@@ -0,0 +1,221 @@
+#pragma once
+
+// Length-prefixed framing shared by the server and the client.
+//
+// A framed connection starts with a 4-byte preamble (0xFF 'O' 'P' version).
+// 0xFF never starts a UTF-8 username, which is how the server tells framed
+// clients from legacy text clients that send their bare name first. After
+// the preamble every message is one frame:
+//
+//     u32 payload length (big-endian) | u8 frame type | payload
+//
+// Payloads are XOR-encrypted with the key stream restarting at each frame.
+// Incoming bytes land in a per-connection ring buffer and frames are parsed
+// where they lie; only a complete frame that wraps around the end of the
+// ring is ever copied out, never a partial one.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <sys/uio.h>
+#include "encryption.h"
+
+namespace Framing
+{
+    constexpr unsigned char MAGIC[3] = {0xFF, 'O', 'P'};
+    constexpr uint8_t VERSION = 1;
+    constexpr size_t PREAMBLE_SIZE = 4;
+    constexpr size_t HEADER_SIZE = 5;
+    constexpr uint32_t MAX_PAYLOAD = 64 * 1024;              // largest frame a client may send
+    constexpr uint32_t MAX_SERVER_PAYLOAD = 16 * 1024 * 1024; // server output (history, /list) can be bigger
+
+    enum class FrameType : uint8_t
+    {
+        Hello = 1, // client -> server, payload is the username
+        Text = 2,  // one chat line or command, or one block of server output
+    };
+
+    class RingBuffer
+    {
+    public:
+        static constexpr size_t DEFAULT_CAPACITY = 4096;
+
+        size_t readable() const { return tail - head; }
+        size_t capacity() const { return cap; }
+
+        // Free space as up to two segments for readv; allocates on first use
+        int writableSegments(iovec *iov)
+        {
+            if (!data)
+                grow(DEFAULT_CAPACITY);
+            size_t free = cap - readable();
+            if (free == 0)
+                return 0;
+            size_t start = tail & (cap - 1);
+            size_t first = std::min(free, cap - start);
+            iov[0].iov_base = data.get() + start;
+            iov[0].iov_len = first;
+            if (first == free)
+                return 1;
+            iov[1].iov_base = data.get();
+            iov[1].iov_len = free - first;
+            return 2;
+        }
+
+        void commit(size_t n) { tail += n; }
+
+        void consume(size_t n)
+        {
+            head += n;
+            if (head == tail)
+                head = tail = 0; // next frame starts at the front, unwrapped
+        }
+
+        // Copies len bytes starting `pos` bytes past the read position
+        void peek(size_t pos, char *out, size_t len) const
+        {
+            size_t start = (head + pos) & (cap - 1);
+            size_t first = std::min(len, cap - start);
+            memcpy(out, data.get() + start, first);
+            memcpy(out + first, data.get(), len - first);
+        }
+
+        // The bytes [pos, pos + len) in place, or nullptr if they wrap
+        char *contiguous(size_t pos, size_t len)
+        {
+            size_t start = (head + pos) & (cap - 1);
+            return start + len <= cap ? data.get() + start : nullptr;
+        }
+
+        // Makes room for `needed` buffered bytes. Only oversized frames get
+        // here, so the one-off copy of what is buffered is acceptable.
+        void reserve(size_t needed)
+        {
+            if (needed > cap)
+                grow(needed);
+        }
+
+        // Idle connections give their buffer back
+        void releaseIfEmpty()
+        {
+            if (readable() == 0 && data)
+            {
+                data.reset();
+                cap = 0;
+                head = tail = 0;
+            }
+        }
+
+    private:
+        std::unique_ptr<char[]> data;
+        size_t cap = 0;  // power of two
+        size_t head = 0; // read position, grows monotonically until reset
+        size_t tail = 0; // write position
+
+        void grow(size_t needed)
+        {
+            size_t newCap = DEFAULT_CAPACITY;
+            while (newCap < needed)
+                newCap <<= 1;
+            std::unique_ptr<char[]> bigger(new char[newCap]);
+            size_t count = readable();
+            if (count)
+                peek(0, bigger.get(), count);
+            data = std::move(bigger);
+            cap = newCap;
+            head = 0;
+            tail = count;
+        }
+    };
+
+    struct Frame
+    {
+        FrameType type;
+        char *payload;   // in the ring, or in the caller's scratch if it wrapped
+        uint32_t length; // payload bytes
+        size_t size;     // header + payload, what to consume once handled
+    };
+
+    enum class ParseStatus { Complete, Incomplete, Invalid };
+
+    inline std::string preamble()
+    {
+        return std::string(reinterpret_cast<const char *>(MAGIC), sizeof(MAGIC)) + static_cast<char>(VERSION);
+    }
+
+    // Consumes the connection preamble; Invalid means wrong magic or version
+    inline ParseStatus readPreamble(RingBuffer &ring)
+    {
+        if (ring.readable() < PREAMBLE_SIZE)
+            return ParseStatus::Incomplete;
+        char bytes[PREAMBLE_SIZE];
+        ring.peek(0, bytes, PREAMBLE_SIZE);
+        if (memcmp(bytes, MAGIC, sizeof(MAGIC)) != 0 || static_cast<uint8_t>(bytes[3]) != VERSION)
+            return ParseStatus::Invalid;
+        ring.consume(PREAMBLE_SIZE);
+        return ParseStatus::Complete;
+    }
+
+    // Finds the frame at the read position. The caller handles it and then
+    // consumes frame.size; the payload is still encrypted.
+    inline ParseStatus nextFrame(RingBuffer &ring, std::string &scratch, Frame &frame,
+                                 uint32_t maxPayload = MAX_PAYLOAD)
+    {
+        if (ring.readable() < HEADER_SIZE)
+            return ParseStatus::Incomplete;
+
+        unsigned char header[HEADER_SIZE];
+        ring.peek(0, reinterpret_cast<char *>(header), HEADER_SIZE);
+        uint32_t length = (uint32_t(header[0]) << 24) | (uint32_t(header[1]) << 16) |
+                          (uint32_t(header[2]) << 8) | uint32_t(header[3]);
+        if (length > maxPayload)
+            return ParseStatus::Invalid;
+
+        size_t size = HEADER_SIZE + length;
+        if (ring.readable() < size)
+        {
+            ring.reserve(size);
+            return ParseStatus::Incomplete;
+        }
+
+        frame.type = static_cast<FrameType>(header[4]);
+        frame.length = length;
+        frame.size = size;
+        frame.payload = ring.contiguous(HEADER_SIZE, length);
+        if (!frame.payload)
+        {
+            scratch.resize(length);
+            ring.peek(HEADER_SIZE, &scratch[0], length);
+            frame.payload = &scratch[0];
+        }
+        return ParseStatus::Complete;
+    }
+
+    // Appends a header announcing `len` payload bytes; the caller appends and encrypts the payload
+    inline void appendHeader(std::string &out, FrameType type, size_t len)
+    {
+        char header[HEADER_SIZE] = {static_cast<char>(len >> 24), static_cast<char>(len >> 16),
+                                    static_cast<char>(len >> 8), static_cast<char>(len),
+                                    static_cast<char>(type)};
+        out.append(header, HEADER_SIZE);
+    }
+
+    // Header plus encrypted payload, ready for the wire
+    inline std::string encode(FrameType type, const char *data, size_t len)
+    {
+        std::string out;
+        out.reserve(HEADER_SIZE + len);
+        appendHeader(out, type, len);
+        out.append(data, len);
+        Encryption::applyInPlace(&out[HEADER_SIZE], len);
+        return out;
+    }
+
+    inline std::string encode(FrameType type, const std::string &text)
+    {
+        return encode(type, text.data(), text.size());
+    }
+}
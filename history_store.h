@@ -0,0 +1,696 @@
+#pragma once
+
+// Segmented per-room history with an asynchronous group-commit writer.
+//
+// Chat threads hand lines to a lock-free multi-producer, single-consumer queue
+// and never touch the disk themselves. One writer thread drains the queue in
+// batches, appends each room's share of a batch with a single write() to the
+// segment it keeps open, and syncs according to the durability policy.
+//
+// A room's log is split into fixed-size segment files, each with a sparse
+// index (message number -> byte offset every INDEX_STRIDE messages). Replay
+// finds the last N messages through the index and reads them from an mmap,
+// and segments past the retention limit are deleted as new ones are started.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "metrics.h"
+#include "room_names.h"
+#include "tracing.h"
+
+// Vyukov's intrusive MPSC queue: push is one exchange plus one store, pop is
+// wait-free for the single consumer. pop() can report empty while a producer
+// is between its two steps; the element shows up on the next call.
+template <typename T>
+class MpscQueue
+{
+public:
+    MpscQueue() : head(&stub), tail(&stub) {}
+
+    ~MpscQueue()
+    {
+        T value;
+        while (pop(value))
+        {
+        }
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    void push(T value)
+    {
+        Node *node = new Node(std::move(value));
+        Node *prev = head.exchange(node);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // Consumer only
+    bool pop(T &out)
+    {
+        Node *first = tail;
+        Node *next = first->next.load(std::memory_order_acquire);
+        if (first == &stub)
+        {
+            if (!next)
+                return false;
+            tail = first = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (!next)
+        {
+            if (first != head.load())
+                return false; // a producer is mid-push
+            // first is the last node; put the stub behind it so it can be taken
+            stub.next.store(nullptr, std::memory_order_relaxed);
+            Node *prev = head.exchange(&stub);
+            prev->next.store(&stub, std::memory_order_release);
+            next = first->next.load(std::memory_order_acquire);
+            if (!next)
+                return false;
+        }
+        tail = next;
+        out = std::move(first->value);
+        delete first;
+        return true;
+    }
+
+    // Consumer only; a push that is still in progress counts as non-empty
+    bool empty() const
+    {
+        return tail == &stub && head.load() == &stub;
+    }
+
+private:
+    struct Node
+    {
+        std::atomic<Node *> next{nullptr};
+        T value;
+        Node() = default;
+        explicit Node(T v) : value(std::move(v)) {}
+    };
+
+    Node stub;
+    std::atomic<Node *> head; // producers push here
+    Node *tail;               // consumer pops here
+};
+
+enum class HistorySync { None, Interval, Count };
+
+struct HistoryOptions
+{
+    HistorySync sync = HistorySync::None; // None: leave flushing to the kernel, like the old ofstream
+    int syncIntervalMs = 1000;            // Interval: fdatasync dirty files this often
+    int syncEveryMessages = 100;          // Count: fdatasync after this many lines
+    size_t segmentBytes = 1024 * 1024;    // a room's log rolls over to a new segment past this size
+    size_t maxSegments = 16;              // segments kept per room; older ones are deleted
+};
+
+class HistoryStore
+{
+public:
+    static constexpr size_t MAX_BATCH = 4096;     // entries taken per group commit
+    static constexpr size_t MAX_OPEN_ROOMS = 256; // least recently written room closed beyond this
+    static constexpr uint64_t INDEX_STRIDE = 64;  // messages per sparse index entry
+
+    HistoryStore(std::string directory, HistoryOptions opts)
+        : dir(std::move(directory)), options(opts) {}
+
+    ~HistoryStore()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        // Once, instead of a stat per message
+        mkdir(dir.c_str(), 0755);
+        mkdir((dir + "/rooms").c_str(), 0755);
+        running = true;
+        worker = std::thread(&HistoryStore::run, this);
+    }
+
+    // Writes out and syncs everything queued so far, then closes the files
+    void stop()
+    {
+        if (!running.exchange(false))
+            return;
+        wake();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    void append(const std::string &room, std::string line)
+    {
+        for (char &c : line)
+        {
+            if (c == '\n' || c == '\r')
+                c = ' '; // one message per line, or recovery and the index would count it twice
+        }
+        enqueue(Entry{room, std::move(line), nullptr});
+    }
+
+    // Runs on the writer thread once every line queued before it is written
+    void post(std::function<void()> task)
+    {
+        enqueue(Entry{std::string(), std::string(), std::move(task)});
+    }
+
+    // Writer thread only, i.e. from a post()ed task. Calls visit(data, len)
+    // for each of the room's last `count` messages, oldest first, straight
+    // out of the mmap'd segments. Returns how many were visited.
+    template <typename Visit>
+    size_t forEachRecent(const std::string &room, size_t count, Visit &&visit)
+    {
+        RoomLog &log = logFor(room);
+        if (count == 0 || log.nextSeq == 0)
+            return 0;
+
+        uint64_t target = log.nextSeq > count ? log.nextSeq - count : 0;
+        size_t s = log.segments.size() - 1;
+        while (s > 0 && log.segments[s].firstSeq > target)
+            --s;
+        target = std::max(target, log.segments[s].firstSeq); // older ones were rotated out
+
+        // Nearest index entry at or before the target, then skip forward line by line
+        const std::vector<IndexEntry> &index = log.segments[s].index;
+        auto entry = std::upper_bound(index.begin(), index.end(), target,
+                                      [](uint64_t seq, const IndexEntry &e) { return seq < e.seq; });
+        uint64_t seq = log.segments[s].firstSeq;
+        uint64_t offset = 0;
+        if (entry != index.begin())
+        {
+            --entry;
+            seq = entry->seq;
+            offset = entry->offset;
+        }
+
+        size_t visited = 0;
+        for (; s < log.segments.size(); ++s, offset = 0)
+        {
+            const Segment &segment = log.segments[s];
+            if (offset == 0)
+                seq = segment.firstSeq;
+            MappedFile map(segmentPath(log, segment.firstSeq, ".log"), segment.bytes);
+            const char *p = map.data + std::min<uint64_t>(offset, map.size);
+            const char *end = map.data + map.size;
+            while (p < end)
+            {
+                const char *newline = static_cast<const char *>(memchr(p, '\n', end - p));
+                size_t len = newline ? newline - p : end - p;
+                if (seq >= target)
+                {
+                    visit(p, len);
+                    ++visited;
+                }
+                ++seq;
+                p += len + 1;
+            }
+        }
+        return visited;
+    }
+
+    uint64_t linesWritten() const { return lines.load(std::memory_order_relaxed); }
+    uint64_t batchesWritten() const { return batches.load(std::memory_order_relaxed); }
+    uint64_t syncCount() const { return syncs.load(std::memory_order_relaxed); }
+    uint64_t writeErrors() const { return errors.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry
+    {
+        std::string room;
+        std::string line;
+        std::function<void()> task;
+    };
+
+    // Sparse index record, also the on-disk format of the .idx files
+    struct IndexEntry
+    {
+        uint64_t seq;    // message number within the room
+        uint64_t offset; // byte offset of that message in its segment
+    };
+
+    struct Segment
+    {
+        uint64_t firstSeq = 0;
+        uint64_t bytes = 0;
+        std::vector<IndexEntry> index; // first message, then every INDEX_STRIDE-th
+    };
+
+    // A room's history: seg_<firstSeq>.log files holding one message per line,
+    // each with a .idx file beside it
+    struct RoomLog
+    {
+        std::string name;
+        std::string path;               // directory of the segments
+        bool loaded = false;
+        std::vector<Segment> segments;  // oldest first, back() is appended to
+        uint64_t nextSeq = 0;
+        int fd = -1;                    // active segment, O_APPEND
+        int indexFd = -1;               // its index
+        std::string pending;            // this batch's lines, written with one write()
+        std::string pendingIndex;       // index records for those lines
+        bool queued = false;            // already in the dirty list
+        bool unsynced = false;          // written since the last fdatasync
+        uint64_t lastUse = 0;
+    };
+
+    // Read-only mapping of a segment; size is clamped to the file on disk
+    struct MappedFile
+    {
+        const char *data = nullptr;
+        size_t size = 0;
+
+        MappedFile(const std::string &path, uint64_t expected)
+        {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return;
+            struct stat st{};
+            if (fstat(fd, &st) == 0)
+                size = std::min<uint64_t>(expected, st.st_size);
+            if (size > 0)
+            {
+                void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p == MAP_FAILED)
+                    size = 0;
+                else
+                    data = static_cast<const char *>(p);
+            }
+            close(fd);
+        }
+
+        ~MappedFile()
+        {
+            if (data)
+                munmap(const_cast<char *>(data), size);
+        }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+    };
+
+    std::string dir;
+    HistoryOptions options;
+    MpscQueue<Entry> queue;
+    std::thread worker;
+    std::atomic<bool> running{false};
+    std::atomic<bool> sleeping{false};
+    std::mutex wakeMutex;
+    std::condition_variable wakeCond;
+
+    // Writer thread only
+    std::unordered_map<std::string, RoomLog> rooms;
+    std::vector<RoomLog *> dirty;
+    size_t openRooms = 0;
+    uint64_t useClock = 0;
+    size_t unsyncedLines = 0;
+    std::chrono::steady_clock::time_point lastSync = std::chrono::steady_clock::now();
+
+    std::atomic<uint64_t> lines{0};
+    std::atomic<uint64_t> batches{0};
+    std::atomic<uint64_t> syncs{0};
+    std::atomic<uint64_t> errors{0};
+
+    void enqueue(Entry entry)
+    {
+        queue.push(std::move(entry));
+        if (sleeping.load())
+            wake();
+    }
+
+    void wake()
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex);
+        wakeCond.notify_one();
+    }
+
+    void run()
+    {
+        while (true)
+        {
+            size_t count = 0;
+            Entry entry;
+            while (count < MAX_BATCH && queue.pop(entry))
+            {
+                if (entry.task)
+                {
+                    writePending();
+                    entry.task();
+                }
+                else
+                {
+                    appendLine(logFor(entry.room), entry.line);
+                }
+                ++count;
+            }
+            if (count > 0)
+            {
+                Metrics::Timer timer(Metrics::HistoryWrite);
+                Trace::Sample sample("history_batch");
+                writePending();
+                batches.fetch_add(1, std::memory_order_relaxed);
+                applySyncPolicy();
+                continue;
+            }
+            writePending();
+            applySyncPolicy();
+
+            if (!running && queue.empty())
+                break;
+
+            // Sleep until a producer wakes us; the timeout drives interval syncs
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            sleeping.store(true);
+            if (queue.empty() && running)
+            {
+                int timeoutMs = options.sync == HistorySync::Interval ? options.syncIntervalMs : 1000;
+                wakeCond.wait_for(lock, std::chrono::milliseconds(timeoutMs));
+            }
+            sleeping.store(false);
+        }
+
+        syncAll();
+        for (auto &entry : rooms)
+            closeFiles(entry.second);
+        rooms.clear();
+    }
+
+    RoomLog &logFor(const std::string &room)
+    {
+        RoomLog &log = rooms[room];
+        log.lastUse = ++useClock;
+        if (!log.loaded)
+        {
+            log.name = room;
+            loadRoom(log);
+        }
+        return log;
+    }
+
+    void appendLine(RoomLog &log, const std::string &line)
+    {
+        size_t size = line.size() + 1;
+        if (log.segments.back().bytes > 0 && log.segments.back().bytes + size > options.segmentBytes)
+        {
+            writeRoom(log);
+            rotate(log);
+        }
+        Segment &active = log.segments.back();
+        if (log.nextSeq == active.firstSeq || log.nextSeq % INDEX_STRIDE == 0)
+        {
+            IndexEntry entry{log.nextSeq, active.bytes};
+            active.index.push_back(entry);
+            log.pendingIndex.append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+        }
+        log.pending += line;
+        log.pending += '\n';
+        active.bytes += size;
+        ++log.nextSeq;
+        ++unsyncedLines;
+        if (!log.queued)
+        {
+            log.queued = true;
+            dirty.push_back(&log);
+        }
+    }
+
+    // One write() per room touched since the last call
+    void writePending()
+    {
+        for (RoomLog *log : dirty)
+        {
+            log->queued = false;
+            writeRoom(*log);
+        }
+        dirty.clear();
+    }
+
+    void writeRoom(RoomLog &log)
+    {
+        if (log.pending.empty())
+            return;
+        if (openFiles(log))
+        {
+            writeAll(log.fd, log.pending);
+            writeAll(log.indexFd, log.pendingIndex);
+            lines.fetch_add(std::count(log.pending.begin(), log.pending.end(), '\n'), std::memory_order_relaxed);
+            log.unsynced = true;
+        }
+        log.pending.clear();
+        log.pendingIndex.clear();
+        if (log.pending.capacity() > 64 * 1024)
+            log.pending.shrink_to_fit(); // one burst should not pin memory
+    }
+
+    void writeAll(int fd, const std::string &bytes)
+    {
+        const char *data = bytes.data();
+        size_t left = bytes.size();
+        while (left > 0)
+        {
+            ssize_t n = write(fd, data, left);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                errors.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            data += n;
+            left -= n;
+        }
+    }
+
+    // Closes the full segment and starts the next one, dropping the oldest past the limit
+    void rotate(RoomLog &log)
+    {
+        closeFiles(log);
+        Segment next;
+        next.firstSeq = log.nextSeq;
+        log.segments.push_back(next);
+        while (log.segments.size() > std::max<size_t>(options.maxSegments, 1))
+        {
+            unlink(segmentPath(log, log.segments.front().firstSeq, ".log").c_str());
+            unlink(segmentPath(log, log.segments.front().firstSeq, ".idx").c_str());
+            log.segments.erase(log.segments.begin());
+        }
+    }
+
+    std::string segmentPath(const RoomLog &log, uint64_t firstSeq, const char *ext) const
+    {
+        char name[48];
+        snprintf(name, sizeof(name), "/seg_%020llu%s", static_cast<unsigned long long>(firstSeq), ext);
+        return log.path + name;
+    }
+
+    bool openFiles(RoomLog &log)
+    {
+        if (log.fd >= 0)
+            return true;
+        if (openRooms >= MAX_OPEN_ROOMS)
+            closeLeastRecent();
+        uint64_t first = log.segments.back().firstSeq;
+        log.fd = open(segmentPath(log, first, ".log").c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        log.indexFd = open(segmentPath(log, first, ".idx").c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (log.fd < 0 || log.indexFd < 0)
+        {
+            errors.fetch_add(1, std::memory_order_relaxed);
+            if (log.fd >= 0)
+                close(log.fd);
+            if (log.indexFd >= 0)
+                close(log.indexFd);
+            log.fd = log.indexFd = -1;
+            return false;
+        }
+        ++openRooms;
+        return true;
+    }
+
+    void closeFiles(RoomLog &log)
+    {
+        if (log.fd < 0 && log.indexFd < 0)
+            return;
+        if (log.unsynced && options.sync != HistorySync::None)
+        {
+            fdatasync(log.fd);
+            fdatasync(log.indexFd);
+        }
+        if (log.fd >= 0)
+            close(log.fd);
+        if (log.indexFd >= 0)
+            close(log.indexFd);
+        log.fd = log.indexFd = -1;
+        log.unsynced = false;
+        --openRooms;
+    }
+
+    void closeLeastRecent()
+    {
+        RoomLog *victim = nullptr;
+        for (auto &entry : rooms)
+        {
+            RoomLog &log = entry.second;
+            if (log.fd >= 0 && (!victim || log.lastUse < victim->lastUse))
+                victim = &log;
+        }
+        if (victim)
+            closeFiles(*victim);
+    }
+
+    // First touch of a room since startup: find its segments and where the log ends
+    void loadRoom(RoomLog &log)
+    {
+        log.loaded = true;
+        log.path = dir + "/rooms/" + RoomNames::fileName(log.name);
+        mkdir(log.path.c_str(), 0755);
+
+        std::vector<uint64_t> firsts;
+        if (DIR *d = opendir(log.path.c_str()))
+        {
+            while (dirent *e = readdir(d))
+            {
+                unsigned long long first;
+                char ext[8];
+                if (sscanf(e->d_name, "seg_%llu.%7s", &first, ext) == 2 && strcmp(ext, "log") == 0)
+                    firsts.push_back(first);
+            }
+            closedir(d);
+        }
+        if (firsts.empty() && RoomNames::valid(log.name))
+        {
+            // A flat history_<room>.txt from before segments becomes segment 0
+            std::string legacy = dir + "/history_" + log.name + ".txt";
+            if (rename(legacy.c_str(), segmentPath(log, 0, ".log").c_str()) == 0)
+                firsts.push_back(0);
+        }
+        std::sort(firsts.begin(), firsts.end());
+
+        for (uint64_t first : firsts)
+        {
+            Segment segment;
+            segment.firstSeq = first;
+            struct stat st{};
+            if (stat(segmentPath(log, first, ".log").c_str(), &st) != 0)
+                continue;
+            segment.bytes = st.st_size;
+            loadIndex(log, segment);
+            log.segments.push_back(std::move(segment));
+        }
+        if (log.segments.empty())
+            log.segments.push_back(Segment());
+
+        // Count the lines after the last index entry to find the next message number
+        const Segment &active = log.segments.back();
+        log.nextSeq = active.firstSeq;
+        uint64_t from = 0;
+        if (!active.index.empty())
+        {
+            log.nextSeq = active.index.back().seq;
+            from = active.index.back().offset;
+        }
+        MappedFile map(segmentPath(log, active.firstSeq, ".log"), active.bytes);
+        if (from < map.size)
+            log.nextSeq += std::count(map.data + from, map.data + map.size, '\n');
+    }
+
+    // Reads a segment's .idx, rebuilding it from the log if it is missing or damaged
+    void loadIndex(const RoomLog &log, Segment &segment)
+    {
+        std::string indexPath = segmentPath(log, segment.firstSeq, ".idx");
+        int fd = open(indexPath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0)
+        {
+            struct stat st{};
+            if (fstat(fd, &st) == 0)
+            {
+                segment.index.resize(st.st_size / sizeof(IndexEntry));
+                size_t want = segment.index.size() * sizeof(IndexEntry);
+                if (pread(fd, segment.index.data(), want, 0) != static_cast<ssize_t>(want))
+                    segment.index.clear();
+            }
+            close(fd);
+        }
+
+        bool valid = !segment.index.empty() && segment.index.front().seq == segment.firstSeq &&
+                     segment.index.front().offset == 0;
+        for (size_t i = 1; valid && i < segment.index.size(); ++i)
+            valid = segment.index[i].seq > segment.index[i - 1].seq &&
+                    segment.index[i].offset > segment.index[i - 1].offset &&
+                    segment.index[i].offset <= segment.bytes;
+        if (valid || segment.bytes == 0)
+        {
+            if (!valid)
+                segment.index.clear();
+            return;
+        }
+
+        segment.index.clear();
+        MappedFile map(segmentPath(log, segment.firstSeq, ".log"), segment.bytes);
+        uint64_t seq = segment.firstSeq;
+        for (const char *p = map.data, *end = map.data + map.size; p < end; ++seq)
+        {
+            if (seq == segment.firstSeq || seq % INDEX_STRIDE == 0)
+                segment.index.push_back(IndexEntry{seq, static_cast<uint64_t>(p - map.data)});
+            const char *newline = static_cast<const char *>(memchr(p, '\n', end - p));
+            p = newline ? newline + 1 : end;
+        }
+        int out = open(indexPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out >= 0)
+        {
+            writeAll(out, std::string(reinterpret_cast<const char *>(segment.index.data()),
+                                      segment.index.size() * sizeof(IndexEntry)));
+            close(out);
+        }
+    }
+
+    void applySyncPolicy()
+    {
+        if (options.sync == HistorySync::Count && unsyncedLines >= static_cast<size_t>(options.syncEveryMessages))
+            syncAll();
+        else if (options.sync == HistorySync::Interval && unsyncedLines > 0 &&
+                 std::chrono::steady_clock::now() - lastSync >= std::chrono::milliseconds(options.syncIntervalMs))
+            syncAll();
+        else if (options.sync == HistorySync::None)
+            unsyncedLines = 0;
+    }
+
+    void syncAll()
+    {
+        for (auto &entry : rooms)
+        {
+            RoomLog &log = entry.second;
+            if (log.fd >= 0 && log.unsynced)
+            {
+                if (options.sync != HistorySync::None)
+                {
+                    fdatasync(log.fd);
+                    fdatasync(log.indexFd);
+                }
+                log.unsynced = false;
+            }
+        }
+        if (options.sync != HistorySync::None)
+            syncs.fetch_add(1, std::memory_order_relaxed);
+        unsyncedLines = 0;
+        lastSync = std::chrono::steady_clock::now();
+    }
+};
@@ -0,0 +1,350 @@
+#pragma once
+
+// Process-wide counters and latency histograms, cheap enough for the message path.
+//
+// Every thread records into a shard of its own with plain relaxed stores: no
+// lock, no atomic read-modify-write, no cache line shared with another core.
+// A scrape walks the shards and adds them up. A finished thread's shard is
+// handed to the next new thread with its totals intact, so counters stay
+// monotonic through thread-per-client churn and the shard list only grows to
+// the peak thread count.
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace Metrics
+{
+    enum Counter
+    {
+        ConnectionsOpened,
+        ConnectionsClosed,
+        TimedOut,
+        ConnectionsShed,
+        BytesIn,
+        BytesOut,
+        SendCalls,
+        RateLimited,
+        SlowmodeRejected,
+        PresenceEvents,
+        PresenceLines,
+        SessionMigrations,
+        RoomMoves,
+        COUNTER_COUNT
+    };
+
+    enum Histogram
+    {
+        HistoryWrite,    // one batch of the history writer, write and sync
+        BroadcastFanout, // one broadcastMessage call
+        HISTOGRAM_COUNT
+    };
+
+    struct CounterInfo
+    {
+        const char *name;
+        const char *help;
+    };
+
+    constexpr CounterInfo COUNTERS[COUNTER_COUNT] = {
+        {"opticom_connections_opened_total", "Connections accepted"},
+        {"opticom_connections_closed_total", "Connections closed"},
+        {"opticom_connections_timed_out_total", "Connections closed by the handshake, idle or keepalive timeout"},
+        {"opticom_connections_shed_total", "Connections closed on accept because the server was out of descriptors"},
+        {"opticom_bytes_in_total", "Bytes read from clients"},
+        {"opticom_bytes_out_total", "Bytes written to clients"},
+        {"opticom_send_calls_total", "sendmsg calls that wrote client output"},
+        {"opticom_rate_limited_total", "Messages rejected by the rate limit"},
+        {"opticom_slowmode_rejected_total", "Messages rejected by room slowmode"},
+        {"opticom_presence_events_total", "Joins and leaves, including room changes"},
+        {"opticom_presence_lines_total", "Presence lines sent to a room, one per event or per summary"},
+        {"opticom_session_migrations_total", "Sessions handed to the I/O loop that owns their room"},
+        {"opticom_room_moves_total", "Rooms moved to another I/O loop by rebalancing"},
+    };
+
+    constexpr CounterInfo HISTOGRAMS[HISTOGRAM_COUNT] = {
+        {"opticom_history_write_seconds", "Time the history writer spends on one batch"},
+        {"opticom_broadcast_seconds", "Time to fan one message out to a room"},
+    };
+
+    // Upper bounds of the histogram buckets in microseconds; one more bucket takes the rest
+    constexpr uint64_t BUCKET_BOUNDS_US[] = {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000,
+                                             25000, 50000, 100000, 250000, 1000000};
+    constexpr size_t BUCKETS = sizeof(BUCKET_BOUNDS_US) / sizeof(BUCKET_BOUNDS_US[0]) + 1;
+
+    // Distinct room labels one shard keeps before folding the rest into OTHER_ROOM,
+    // so user-chosen room names cannot grow a scrape without bound
+    constexpr size_t MAX_ROOMS_PER_SHARD = 1024;
+    constexpr const char *OTHER_ROOM = "_other";
+
+    struct RoomCounts
+    {
+        uint64_t messagesIn = 0;  // chat messages posted to the room
+        uint64_t messagesOut = 0; // copies queued for its members
+    };
+
+    struct HistogramCounts
+    {
+        uint64_t buckets[BUCKETS] = {}; // per bucket, not cumulative
+        uint64_t count = 0;
+        uint64_t sumNs = 0;
+
+        // Upper bound of the bucket holding the q-th quantile, in microseconds; 0 if empty
+        uint64_t quantileUs(double q) const
+        {
+            if (count == 0)
+                return 0;
+            uint64_t rank = static_cast<uint64_t>(q * (count - 1)) + 1, seen = 0;
+            for (size_t i = 0; i + 1 < BUCKETS; ++i)
+            {
+                seen += buckets[i];
+                if (seen >= rank)
+                    return BUCKET_BOUNDS_US[i];
+            }
+            return BUCKET_BOUNDS_US[BUCKETS - 2];
+        }
+    };
+
+    // Everything merged across threads at one scrape
+    struct Snapshot
+    {
+        uint64_t counters[COUNTER_COUNT] = {};
+        HistogramCounts histograms[HISTOGRAM_COUNT];
+        std::map<std::string, RoomCounts> rooms;
+    };
+
+    namespace detail
+    {
+        // Written by one thread at a time, read by scrapes
+        struct Cell
+        {
+            std::atomic<uint64_t> value{0};
+
+            void add(uint64_t n)
+            {
+                value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+
+            uint64_t get() const
+            {
+                return value.load(std::memory_order_relaxed);
+            }
+        };
+
+        struct HistogramCells
+        {
+            Cell buckets[BUCKETS];
+            Cell count;
+            Cell sumNs;
+        };
+
+        struct RoomCells
+        {
+            Cell in;
+            Cell out;
+        };
+
+        struct alignas(64) Shard
+        {
+            Cell counters[COUNTER_COUNT];
+            HistogramCells histograms[HISTOGRAM_COUNT];
+            std::mutex roomsMutex; // the owner takes it to insert, scrapes to iterate; owner lookups skip it
+            std::unordered_map<std::string, std::unique_ptr<RoomCells>> rooms;
+            std::atomic<bool> inUse{true};
+            Shard *next = nullptr;
+        };
+
+        // Deliberately leaked, like Epoch's domain: threads may record during exit
+        inline std::atomic<Shard *> &shards()
+        {
+            static auto *head = new std::atomic<Shard *>(nullptr);
+            return *head;
+        }
+
+        inline Shard *acquireShard()
+        {
+            for (Shard *s = shards().load(); s; s = s->next)
+            {
+                bool expected = false;
+                if (!s->inUse.load(std::memory_order_relaxed) && s->inUse.compare_exchange_strong(expected, true))
+                    return s;
+            }
+            Shard *s = new Shard;
+            s->next = shards().load();
+            while (!shards().compare_exchange_weak(s->next, s))
+            {
+            }
+            return s;
+        }
+
+        struct ShardHolder
+        {
+            Shard *shard = nullptr;
+            ~ShardHolder()
+            {
+                if (shard)
+                    shard->inUse.store(false);
+            }
+        };
+
+        inline Shard &localShard()
+        {
+            thread_local ShardHolder holder;
+            if (!holder.shard)
+                holder.shard = acquireShard();
+            return *holder.shard;
+        }
+
+        inline RoomCells &roomCells(Shard &shard, const std::string &room)
+        {
+            auto found = shard.rooms.find(room);
+            if (found != shard.rooms.end())
+                return *found->second;
+            bool full = shard.rooms.size() >= MAX_ROOMS_PER_SHARD;
+            if (full && (found = shard.rooms.find(OTHER_ROOM)) != shard.rooms.end())
+                return *found->second;
+            std::string key = full ? std::string(OTHER_ROOM) : room;
+            std::lock_guard<std::mutex> lock(shard.roomsMutex);
+            auto &cells = shard.rooms[key];
+            if (!cells)
+                cells.reset(new RoomCells);
+            return *cells;
+        }
+    }
+
+    inline void add(Counter counter, uint64_t n = 1)
+    {
+        detail::localShard().counters[counter].add(n);
+    }
+
+    inline void observe(Histogram histogram, uint64_t ns)
+    {
+        detail::HistogramCells &h = detail::localShard().histograms[histogram];
+        size_t bucket = 0;
+        while (bucket + 1 < BUCKETS && ns > BUCKET_BOUNDS_US[bucket] * 1000)
+            ++bucket;
+        h.buckets[bucket].add(1);
+        h.count.add(1);
+        h.sumNs.add(ns);
+    }
+
+    inline void roomMessages(const std::string &room, uint64_t in, uint64_t out)
+    {
+        detail::RoomCells &cells = detail::roomCells(detail::localShard(), room);
+        if (in)
+            cells.in.add(in);
+        if (out)
+            cells.out.add(out);
+    }
+
+    // Observes the lifetime of the scope
+    class Timer
+    {
+    public:
+        explicit Timer(Histogram h) : histogram(h), start(std::chrono::steady_clock::now()) {}
+
+        ~Timer()
+        {
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            observe(histogram, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        }
+
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+    private:
+        Histogram histogram;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    inline Snapshot collect()
+    {
+        Snapshot snap;
+        for (detail::Shard *s = detail::shards().load(); s; s = s->next)
+        {
+            for (size_t c = 0; c < COUNTER_COUNT; ++c)
+                snap.counters[c] += s->counters[c].get();
+            for (size_t h = 0; h < HISTOGRAM_COUNT; ++h)
+            {
+                for (size_t b = 0; b < BUCKETS; ++b)
+                    snap.histograms[h].buckets[b] += s->histograms[h].buckets[b].get();
+                snap.histograms[h].count += s->histograms[h].count.get();
+                snap.histograms[h].sumNs += s->histograms[h].sumNs.get();
+            }
+            std::lock_guard<std::mutex> lock(s->roomsMutex);
+            for (auto &entry : s->rooms)
+            {
+                RoomCounts &room = snap.rooms[entry.first];
+                room.messagesIn += entry.second->in.get();
+                room.messagesOut += entry.second->out.get();
+            }
+        }
+        return snap;
+    }
+
+    // Label values may hold anything a user typed as a room name
+    inline std::string escapeLabel(const std::string &value)
+    {
+        std::string out;
+        for (char c : value)
+        {
+            if (c == '\\' || c == '"')
+                out += '\\';
+            if (c == '\n')
+            {
+                out += "\\n";
+                continue;
+            }
+            out += c;
+        }
+        return out;
+    }
+
+    // The snapshot in the Prometheus text exposition format
+    inline void appendPrometheus(std::string &out, const Snapshot &snap)
+    {
+        for (size_t c = 0; c < COUNTER_COUNT; ++c)
+        {
+            out += std::string("# HELP ") + COUNTERS[c].name + " " + COUNTERS[c].help + "\n";
+            out += std::string("# TYPE ") + COUNTERS[c].name + " counter\n";
+            out += std::string(COUNTERS[c].name) + " " + std::to_string(snap.counters[c]) + "\n";
+        }
+
+        const char *roomSeries[2][2] = {{"opticom_room_messages_in_total", "Chat messages posted, by room"},
+                                        {"opticom_room_messages_out_total", "Message copies queued for members, by room"}};
+        for (int series = 0; series < 2; ++series)
+        {
+            out += std::string("# HELP ") + roomSeries[series][0] + " " + roomSeries[series][1] + "\n";
+            out += std::string("# TYPE ") + roomSeries[series][0] + " counter\n";
+            for (auto &entry : snap.rooms)
+            {
+                uint64_t value = series == 0 ? entry.second.messagesIn : entry.second.messagesOut;
+                out += std::string(roomSeries[series][0]) + "{room=\"" + escapeLabel(entry.first) + "\"} " +
+                       std::to_string(value) + "\n";
+            }
+        }
+
+        for (size_t h = 0; h < HISTOGRAM_COUNT; ++h)
+        {
+            const HistogramCounts &counts = snap.histograms[h];
+            std::string name = HISTOGRAMS[h].name;
+            out += "# HELP " + name + " " + HISTOGRAMS[h].help + "\n";
+            out += "# TYPE " + name + " histogram\n";
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b < BUCKETS; ++b)
+            {
+                cumulative += counts.buckets[b];
+                std::string le = b + 1 < BUCKETS ? std::to_string(BUCKET_BOUNDS_US[b] / 1e6) : "+Inf";
+                out += name + "_bucket{le=\"" + le + "\"} " + std::to_string(cumulative) + "\n";
+            }
+            out += name + "_sum " + std::to_string(counts.sumNs / 1e9) + "\n";
+            out += name + "_count " + std::to_string(counts.count) + "\n";
+        }
+    }
+}
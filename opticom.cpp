@@ -6,6 +6,7 @@
 #include <cstring>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <signal.h>
@@ -17,6 +18,37 @@
 #include <unordered_map>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <memory>
+#include <atomic>
+#include <deque>
+#include <condition_variable>
+#include <functional>
+#include <array>
+#include <charconv>
+#include <string_view>
+#include "encryption.h"
+#include "framing.h"
+#include "history_store.h"
+#include "room_names.h"
+#include "room_cache.h"
+#include "pin_store.h"
+#include "client_registry.h"
+#include "rate_limiter.h"
+#include "user_ids.h"
+#include "room_scheduler.h"
+#include "fanout_pool.h"
+#include "timer_wheel.h"
+#include "presence.h"
+#include "metrics.h"
+#include "tracing.h"
 
 using namespace std;
 
@@ -30,84 +62,209 @@ using namespace std;
 #define COLOR_CYAN    "\033[36m"
 #define COLOR_RED     "\033[31m"
 
-// Simple XOR encryption/decryption
-namespace Encryption
-{
-    const string KEY = "OpticomSecureKey2025"; // Shared key
-    
-    string encrypt(const string &plaintext)
-    {
-        string result = plaintext;
-        for (size_t i = 0; i < result.length(); ++i)
-        {
-            result[i] ^= KEY[i % KEY.length()];
-        }
-        return result;
-    }
-    
-    string decrypt(const string &ciphertext)
-    {
-        return encrypt(ciphertext); // XOR is symmetric
-    }
-}
 
-struct ClientInfo
+// Immutable encrypted bytes. A broadcast encodes once and every recipient's
+// outbox holds a reference to the same buffer instead of its own copy.
+using Payload = shared_ptr<const string>;
+
+struct IoLoop;
+
+struct ClientInfo : enable_shared_from_this<ClientInfo>
 {
     int socket;
     string name;
     string addr;
     string room = "general";
-    vector<string> blockedUsers; // List of blocked usernames
+    size_t roomSlot = SIZE_MAX;  // position in the room's member list, owned by the registry
+    uint32_t userId = 0;               // interned name, set at handshake
+    Epoch::RcuPtr<IdSet> blockedUsers; // ids; read lock-free by other clients' broadcasts
+
+    TokenBucket rateBucket;     // message rate, refilled at the room's or the global limit
+    TokenBucket slowmodeBucket; // one message per slowmode interval, independent of the rate
+
+    // Connection state machine (the reactor drives it one read at a time).
+    // Atomic because thread mode checks timeouts on the output loop.
+    enum class State { Handshake, Active, Closed };
+    atomic<State> state{State::Handshake};
+    mutex writeMutex;          // guards the outbox fields, closed and the socket for writes
+    deque<Payload> outbox;     // encrypted messages the kernel has not accepted yet
+    size_t outboxBytes = 0;    // unsent bytes across the whole outbox
+    size_t outboxHead = 0;     // bytes of outbox.front() already written
+    bool slow = false;         // crossed the high watermark, not yet back under the low one
+    bool closed = false;       // set under writeMutex right before close()
+    bool flushQueued = false;  // waiting in an OutputBatch for its write
+
+    // Wire protocol, decided by the first byte the client sends
+    enum class Protocol { Unknown, Text, Framed };
+    Protocol protocol = Protocol::Unknown;
+    bool preambleSeen = false;
+    Framing::RingBuffer inbox; // framed clients only; released while idle
+
+    // Reactor mode: the loop serving the session. Only that loop changes it,
+    // when the session follows its room to another loop.
+    atomic<IoLoop *> loop{nullptr};
+
+    // Deadlines: the handshake is due acceptedNs + timeout, idle and keepalive
+    // count from lastHeardNs. Reads only stamp the time; the timer, armed on
+    // the loop holding the session in its conns, looks at it when it fires.
+    int64_t acceptedNs;
+    atomic<int64_t> lastHeardNs;
+    TimerWheel::Timer timer;
 
-    chrono::steady_clock::time_point lastMsgTime = chrono::steady_clock::now();
-    int msgCount = 0;
     ClientInfo(int s, const string &n, const string &a, const string &r)
-        : socket(s), name(n), addr(a), room(r) {}
+        : socket(s), name(n), addr(a), room(r), acceptedNs(TokenBucket::nowNs()), lastHeardNs(acceptedNs) {}
+};
+
+enum class ServerMode { Threads, Epoll };
+
+// What happens to a client whose outbound queue crosses the high watermark
+enum class SlowConsumerPolicy { DropOldest, DropNew, Disconnect };
+
+struct ServerConfig
+{
+    int port = 8080;
+    ServerMode mode = ServerMode::Threads;
+    int ioThreads = 4;          // reactor threads in epoll mode
+    int listeners = 1;          // >1 binds that many SO_REUSEPORT sockets
+    int backlog = SOMAXCONN;    // listen() backlog per listener
+    int acceptBatch = 64;       // accept4 calls per readiness notification
+    vector<int> cpus;           // cores to pin reactor/accept threads to (round robin)
+    size_t queueHighWatermark = 256 * 1024; // queued bytes before a client counts as slow
+    size_t queueLowWatermark = 64 * 1024;   // a slow client recovers once drained below this
+    SlowConsumerPolicy slowPolicy = SlowConsumerPolicy::DropOldest;
+    HistoryOptions history;                 // durability, segment size and retention of the history
+    size_t historyReplay = 100;             // messages replayed to a client joining a room
+    size_t cacheRoomBytes = 64 * 1024;      // recent-message ring per cached room
+    size_t cacheBytes = 64 * 1024 * 1024;   // all rings together; least recently used rooms go first
+    RateLimit rateLimit{3, 3};              // per-client messages/second and burst, unless a room overrides it
+    int metricsPort = 0;                    // Prometheus text endpoint on 127.0.0.1, 0 disables
+    int rebalanceMs = 1000;                 // reactor mode: how often room placement is checked for skew, 0 disables
+    size_t parallelFanout = 4096;           // rooms with at least this many members fan out on the pool, 0 disables
+    int fanoutThreads = 0;                  // fan-out pool size, 0 = one per core
+    int handshakeTimeout = 10;              // seconds to send a username before the connection is closed, 0 disables
+    int idleTimeout = 0;                    // seconds without input before a session is closed, 0 disables
+    int keepalive = 60;                     // seconds of silence before the peer is checked for life, 0 disables
+    int presenceWindowMs = 500;             // joins and leaves are summed up per room this long, 0 announces each
+    bool presenceHistory = true;            // presence lines go to the room history as well
+};
+
+// Per-room moderation settings; rooms without an entry use the defaults
+struct RoomRules
+{
+    int slowmodeSeconds = 0;
+    bool ownRate = false; // rate overrides the global limit
+    RateLimit rate;
+};
+
+// Read on every chat message, changed only from the admin console
+struct ChatRules
+{
+    RateLimit rate;
+    unordered_map<string, RoomRules> rooms;
+};
+
+// One edge-triggered epoll instance driven by a single I/O thread
+struct IoLoop
+{
+    int index = 0;
+    bool writeOnly = false;                           // thread mode: only drains outboxes on EPOLLOUT
+    int epollFd = -1;
+    int wakeFd = -1;                                  // eventfd, signals posted tasks
+    vector<int *> listeners;                          // SO_REUSEPORT sockets accepted on this loop
+    mutex tasksMutex;
+    vector<function<void()>> tasks;                   // work other threads handed to this loop
+    unordered_map<int, shared_ptr<ClientInfo>> conns; // owned by the loop thread only
+    vector<shared_ptr<ClientInfo>> closing;           // released after the current epoll batch
+    unordered_map<string, uint64_t> roomTraffic;      // copies fanned out per room since the last rebalance check
+
+    static constexpr int64_t TICK_NS = 100 * 1000000;  // timer resolution
+    int64_t now = TokenBucket::nowNs();               // steady clock as of the loop's last wakeup
+    TimerWheel timers{TICK_NS, now};                  // deadlines of the sessions in conns, and housekeeping
+    TimerWheel::Timer acceptResume;                   // re-arms the listeners after an out-of-descriptors pause
 };
 
 class ChatServer
 {
 private:
-    int serverSocket;
+    vector<unique_ptr<int>> listenSockets; // heap cells double as epoll tags
+    int spareFd = -1;                      // /dev/null, given up to shed a connection when out of descriptors
+    mutex spareMutex;
     int port;
-    vector<ClientInfo> clients;
-    mutex clientsMutex;
-    bool running;
-    unordered_map<string, int> roomSlowmodeSeconds; // seconds per room
+    ServerConfig config;
+    ClientRegistry<ClientInfo> registry; // sessions and room members; broadcasts read it lock-free
+    atomic<bool> running;
+    Epoch::RcuPtr<ChatRules> rules; // rate limits and slowmode, read lock-free per message
+    vector<unique_ptr<IoLoop>> ioLoops;
+    atomic<size_t> nextLoop{0};
+    unique_ptr<IoLoop> outputLoop; // thread mode: drains outboxes the handler threads left behind
+    int metricsSocket = -1;        // HTTP scrape listener, owned by metricsLoop
+
+    // How often each slow-consumer policy fired
+    atomic<uint64_t> slowDroppedOldest{0};
+    atomic<uint64_t> slowDroppedNew{0};
+    atomic<uint64_t> slowDisconnects{0};
+
+    HistoryStore history; // appends history lines off the message path
+    RoomCache recent;     // last messages of active rooms, so joins skip the disk
+    PinStore pins;        // pin boards; their log is written on the history thread
+    UserIds userIds;      // username -> dense id, so blocklists compare integers
+    RoomScheduler scheduler; // reactor mode: the loop that owns each room
+    unique_ptr<FanoutPool> fanoutPool; // splits broadcasts to very large rooms across cores; see fanoutWorkers()
+    once_flag fanoutStarted;
+    unordered_map<string, unique_ptr<TimerWheel::Timer>> slowmodeEnds; // housekeeping loop only
+    PresenceBatcher presence;          // joins and leaves waiting for their room's summary
+    TimerWheel::Timer presenceFlush;   // housekeeping loop only; due when the oldest batch is
+
+    static constexpr size_t FANOUT_GRAIN = 512; // members one pool task sends to
+    static constexpr int64_t NS_PER_SECOND = 1000000000;
+
+    inline static thread_local IoLoop *currentLoop = nullptr; // the reactor loop running on this thread
+
+    static constexpr int ACCEPT_BACKOFF_MS = 100; // listener pause when a connection can be neither accepted nor shed
+    static constexpr size_t MAX_NAME = 63;      // bytes of a username
+    static constexpr size_t MAX_BLOCKED = 1000; // blocklist entries per session
+
+    friend struct ServerBench; // bench/server_bench.cpp times the hot paths directly
 
 public:
-    ChatServer(int port) : port(port), running(false)
+    ChatServer(const ServerConfig &cfg) : port(cfg.port), config(cfg), running(false), history("history", cfg.history),
+          recent(cfg.historyReplay, cfg.cacheRoomBytes, cfg.cacheBytes,
+                 [this](const string &room, uint64_t id) { history.post([this, room, id] { seedRecent(room, id); }); }),
+          pins("history", [this](function<void()> task) { history.post(move(task)); }),
+          scheduler(cfg.mode == ServerMode::Epoll ? max(1, cfg.ioThreads) : 0),
+          presence(cfg.presenceWindowMs * 1000000LL), presenceFlush([this] { flushPresence(housekeepingLoop()); })
     {
-        serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-        if (serverSocket < 0)
-            throw runtime_error("Failed to create socket");
-
-        int opt = 1;
-        if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
-            throw runtime_error("Failed to set socket options");
+        rules.update([&cfg](ChatRules &r) { r.rate = cfg.rateLimit; });
     }
 
     ~ChatServer()
     {
         stop();
-        if (serverSocket >= 0)
-            close(serverSocket);
     }
 
     void start()
     {
-        sockaddr_in serverAddr{};
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_addr.s_addr = INADDR_ANY;
-        serverAddr.sin_port = htons(port);
-
-        if (::bind(serverSocket, (sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
-            throw runtime_error("Failed to bind socket to port " + to_string(port));
-
-        if (listen(serverSocket, 10) < 0)
-            throw runtime_error("Failed to listen on socket");
+        // Several listeners share the port through SO_REUSEPORT and the kernel spreads
+        // incoming connections across them, so each accept path scales with its core
+        bool reusePort = config.listeners > 1;
+        for (int i = 0; i < config.listeners; ++i)
+            listenSockets.push_back(make_unique<int>(openListener(reusePort)));
 
+        spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
         running = true;
+        history.start();
+        pins.preload("general"); // everyone starts there
+        if (config.metricsPort > 0)
+        {
+            metricsSocket = openMetricsListener();
+            thread(&ChatServer::metricsLoop, this, metricsSocket).detach();
+        }
+        if (config.mode == ServerMode::Epoll)
+            startIoLoops(reusePort);
+        else
+            startOutputLoop();
+        if (config.mode == ServerMode::Epoll && config.rebalanceMs > 0 && ioLoops.size() > 1)
+            thread(&ChatServer::rebalanceLoop, this).detach();
         
         // Display startup banner
         cout << "\n" << COLOR_BOLD << COLOR_CYAN;
@@ -117,66 +274,381 @@ public:
         cout << "                                                \n";
         cout << "================================================\n" << COLOR_RESET;
         cout << COLOR_GREEN << "✓ Server started on port " << port << COLOR_RESET << endl;
+        if (config.mode == ServerMode::Epoll)
+            cout << COLOR_GREEN << "✓ Reactor mode: " << ioLoops.size() << " epoll I/O threads" << COLOR_RESET << endl;
+        if (reusePort)
+            cout << COLOR_GREEN << "✓ " << listenSockets.size() << " SO_REUSEPORT listeners, backlog " << config.backlog << COLOR_RESET << endl;
+        if (metricsSocket >= 0)
+            cout << COLOR_GREEN << "✓ Metrics on http://127.0.0.1:" << config.metricsPort << "/metrics" << COLOR_RESET << endl;
         cout << COLOR_BLUE << " Waiting for clients to connect...\n" << COLOR_RESET;
         cout << COLOR_MAGENTA << " Admin commands: type 'help' for options\n" << COLOR_RESET;
         cout << string(50, '-') << "\n" << endl;
 
         thread(&ChatServer::adminConsole, this).detach();
 
+        if (config.mode == ServerMode::Epoll && reusePort)
+        {
+            // Every listener is owned by an I/O loop, nothing left to do here
+            while (running)
+                this_thread::sleep_for(chrono::milliseconds(200));
+            return;
+        }
+
+        for (size_t i = 1; i < listenSockets.size(); ++i)
+            thread(&ChatServer::acceptLoop, this, *listenSockets[i], i).detach();
+        acceptLoop(*listenSockets[0], 0);
+    }
+
+    void stop()
+    {
+        running = false;
+        for (auto &fd : listenSockets)
+        {
+            if (*fd >= 0)
+                close(*fd);
+            *fd = -1;
+        }
+        {
+            lock_guard<mutex> lock(spareMutex);
+            if (spareFd >= 0)
+                close(spareFd);
+            spareFd = -1;
+        }
+        if (metricsSocket >= 0)
+            shutdown(metricsSocket, SHUT_RDWR); // wakes metricsLoop, which closes it
+        // Owners (handler threads / I/O loops) close their own sockets once they see EOF
+        registry.forEachSession([](const shared_ptr<ClientInfo> &c) { shutdown(c->socket, SHUT_RDWR); });
+        history.stop(); // writes out and syncs whatever is still queued
+    }
+
+private:
+    int openListener(bool reusePort)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            throw runtime_error("Failed to create socket");
+
+        int opt = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+            throw runtime_error("Failed to set socket options");
+        if (reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+            throw runtime_error("Failed to set SO_REUSEPORT");
+
+        sockaddr_in serverAddr{};
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_addr.s_addr = INADDR_ANY;
+        serverAddr.sin_port = htons(port);
+
+        if (::bind(fd, (sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
+            throw runtime_error("Failed to bind socket to port " + to_string(port));
+
+        if (listen(fd, config.backlog) < 0)
+            throw runtime_error("Failed to listen on socket");
+        return fd;
+    }
+
+    // Dedicated accept thread for a listener no I/O loop owns
+    void acceptLoop(int listenFd, size_t index)
+    {
+        if (config.mode == ServerMode::Threads)
+            pinCurrentThread(index);
+        pollfd pfd{listenFd, POLLIN, 0};
         while (running)
+        {
+            if (poll(&pfd, 1, -1) <= 0)
+                continue;
+            if (!acceptBatch(listenFd, nullptr))
+                this_thread::sleep_for(chrono::milliseconds(ACCEPT_BACKOFF_MS));
+        }
+    }
+
+    // Drains up to acceptBatch pending connections per wakeup. Listeners are
+    // level-triggered, so a storm larger than one batch is picked up next round
+    // without starving the connections already served by the same thread.
+    // False if accepting fails for want of resources and nothing could be
+    // shed; the caller then leaves the listener alone for ACCEPT_BACKOFF_MS.
+    bool acceptBatch(int listenFd, IoLoop *owner)
+    {
+        int flags = SOCK_CLOEXEC;
+        if (config.mode == ServerMode::Epoll)
+            flags |= SOCK_NONBLOCK;
+
+        for (int i = 0; i < config.acceptBatch; ++i)
         {
             sockaddr_in clientAddr{};
             socklen_t clientAddrLen = sizeof(clientAddr);
-            int clientSocket = accept(serverSocket, (sockaddr *)&clientAddr, &clientAddrLen);
+            int clientSocket = accept4(listenFd, (sockaddr *)&clientAddr, &clientAddrLen, flags);
             if (clientSocket < 0)
-                continue;
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if ((errno == EMFILE || errno == ENFILE) && shedConnection(listenFd))
+                    continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            Metrics::add(Metrics::ConnectionsOpened);
+            int noDelay = 1; // output is already coalesced per tick, Nagle would only delay it
+            setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+            if (config.keepalive > 0)
+                enableKeepalive(clientSocket);
 
-            string clientIp = inet_ntoa(clientAddr.sin_addr);
-            int clientPort = ntohs(clientAddr.sin_port);
-            string addrStr = clientIp + ":" + to_string(clientPort);
+            char ip[INET_ADDRSTRLEN] = "?";
+            inet_ntop(AF_INET, &clientAddr.sin_addr, ip, sizeof(ip));
+            string addrStr = string(ip) + ":" + to_string(ntohs(clientAddr.sin_port));
 
-            thread(&ChatServer::handleClient, this, clientSocket, addrStr).detach();
+            if (config.mode == ServerMode::Threads)
+            {
+                thread(&ChatServer::handleClient, this, clientSocket, addrStr).detach();
+                continue;
+            }
+            auto client = make_shared<ClientInfo>(clientSocket, "", addrStr, "general");
+            if (owner)
+                adoptClient(*owner, client); // stays on the loop that accepted it
+            else
+                dispatchToLoop(client);
         }
+        return true;
     }
 
-    void stop()
+    // Out of descriptors, a pending connection would keep the listener ready
+    // and its thread spinning until one frees up. Gives up the spare
+    // descriptor just long enough to accept the connection and close it, so
+    // the peer is turned away at once instead of waiting in the backlog.
+    bool shedConnection(int listenFd)
     {
-        running = false;
-        if (serverSocket >= 0)
-            close(serverSocket);
-        lock_guard<mutex> lock(clientsMutex);
-        for (auto &c : clients)
-            close(c.socket);
-        clients.clear();
+        lock_guard<mutex> lock(spareMutex);
+        if (spareFd < 0)
+            spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (spareFd < 0)
+            return false;
+        close(spareFd);
+        int shed = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        int acceptErrno = errno;
+        if (shed >= 0)
+        {
+            close(shed);
+            Metrics::add(Metrics::ConnectionsShed);
+        }
+        spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return shed >= 0 || acceptErrno == EAGAIN || acceptErrno == EWOULDBLOCK; // the next accept4 sees the queue empty
     }
 
-private:
-    static bool sendAll(int sock, const char* data, size_t len)
+    void pinCurrentThread(size_t index)
+    {
+        if (config.cpus.empty())
+            return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(config.cpus[index % config.cpus.size()], &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            cerr << COLOR_YELLOW << "⚠ Could not pin thread to CPU " << config.cpus[index % config.cpus.size()] << COLOR_RESET << endl;
+    }
+
+    bool sendAll(ClientInfo &client, const char* data, size_t len)
     {
         // Encrypt before sending
-        string plaintext(data, len);
-        string encrypted = Encryption::encrypt(plaintext);
-        
-        size_t totalSent = 0;
-        const char* encData = encrypted.c_str();
-        size_t encLen = encrypted.length();
-        
-        while (totalSent < encLen)
+        auto bytes = make_shared<string>();
+        appendEncoded(*bytes, data, len, client.protocol == ClientInfo::Protocol::Framed, false);
+        return sendPayload(client, bytes);
+    }
+
+    // Encrypts once into a buffer all recipients can share. The XOR key stream
+    // restarts with every packet, so a trailing newline is encrypted on its own,
+    // exactly as if it had been sent separately.
+    static Payload encodePayload(const string &plaintext, bool newline)
+    {
+        auto bytes = make_shared<string>();
+        appendEncoded(*bytes, plaintext.data(), plaintext.size(), false, newline);
+        return bytes;
+    }
+
+    // The same text as one frame for framed clients; the newline travels
+    // inside the frame rather than as a packet of its own
+    static Payload encodeFrame(const string &plaintext, bool newline)
+    {
+        auto bytes = make_shared<string>();
+        appendEncoded(*bytes, plaintext.data(), plaintext.size(), true, newline);
+        return bytes;
+    }
+
+    // Queues the payload for the client and writes whatever the kernel takes
+    // right away, or when the thread's open OutputBatch closes. Never blocks: a
+    // reader that stops draining only grows its own bounded queue, the rest is
+    // flushed by an I/O loop on EPOLLOUT.
+    bool sendPayload(ClientInfo &client, const Payload &payload)
+    {
+        Trace::TimedLock<mutex> lock(client.writeMutex, "wait writeMutex", "hold writeMutex");
+        if (client.closed)
+            return false;
+        if (!enqueueLocked(client, payload))
+            return false;
+        if (OutputBatch::current)
+        {
+            if (!client.flushQueued)
+            {
+                client.flushQueued = true;
+                OutputBatch::current->pending.push_back(client.shared_from_this());
+            }
+            return true;
+        }
+        Trace::Span span("send", static_cast<int64_t>(payload->size()));
+        return writeOutboxLocked(client);
+    }
+
+    // One tick of output on this thread: while it is open, sendPayload only
+    // queues, and closing it writes each connection it touched with a single
+    // sendmsg, however many messages the tick produced for it. Nested batches
+    // leave the flush to the outermost one.
+    class OutputBatch
+    {
+    public:
+        inline static thread_local OutputBatch *current = nullptr;
+        vector<shared_ptr<ClientInfo>> pending;
+
+        explicit OutputBatch(ChatServer &s) : server(s), outer(current)
+        {
+            if (!outer)
+                current = this;
+        }
+
+        ~OutputBatch()
+        {
+            if (outer)
+                return;
+            current = nullptr;
+            server.flushBatch(pending);
+        }
+
+        OutputBatch(const OutputBatch &) = delete;
+        OutputBatch &operator=(const OutputBatch &) = delete;
+
+    private:
+        ChatServer &server;
+        OutputBatch *outer;
+    };
+
+    void flushBatch(const vector<shared_ptr<ClientInfo>> &pending)
+    {
+        for (auto &c : pending)
+        {
+            Trace::TimedLock<mutex> lock(c->writeMutex, "wait writeMutex", "hold writeMutex");
+            c->flushQueued = false;
+            Trace::Span span("send", static_cast<int64_t>(c->outboxBytes));
+            if (!c->closed && !writeOutboxLocked(*c))
+                shutdown(c->socket, SHUT_RDWR); // owner sees EOF and cleans up
+        }
+    }
+
+    // Applies the watermarks and the slow-consumer policy; false means disconnect
+    bool enqueueLocked(ClientInfo &client, const Payload &bytes)
+    {
+        if (client.outboxBytes + bytes->size() > config.queueHighWatermark)
+            client.slow = true;
+
+        if (client.slow)
+        {
+            switch (config.slowPolicy)
+            {
+            case SlowConsumerPolicy::DropNew:
+                slowDroppedNew++;
+                return true;
+            case SlowConsumerPolicy::Disconnect:
+                slowDisconnects++;
+                client.outbox.clear();
+                client.outboxBytes = client.outboxHead = 0;
+                return false;
+            case SlowConsumerPolicy::DropOldest:
+                break;
+            }
+        }
+
+        client.outboxBytes += bytes->size();
+        client.outbox.push_back(bytes);
+
+        // A partly written head must go out whole, so eviction starts behind it
+        while (client.slow && client.outboxBytes > config.queueHighWatermark && client.outbox.size() > 1)
         {
-            ssize_t n = send(sock, encData + totalSent, encLen - totalSent, 0);
-            if (n <= 0) return false;
-            totalSent += static_cast<size_t>(n);
+            auto victim = client.outboxHead > 0 ? client.outbox.begin() + 1 : client.outbox.begin();
+            client.outboxBytes -= (*victim)->size();
+            client.outbox.erase(victim);
+            slowDroppedOldest++;
         }
         return true;
     }
 
-    static void ensureHistoryDir()
+    // Gathers up to MAX_IOV queued payloads into each sendmsg
+    bool writeOutboxLocked(ClientInfo &client)
     {
-        struct stat st{};
-        if (stat("history", &st) != 0)
+        const size_t MAX_IOV = 64;
+        while (!client.outbox.empty())
         {
-            mkdir("history", 0755);
+            iovec iov[MAX_IOV];
+            size_t count = 0, wanted = 0;
+            for (auto it = client.outbox.begin(); it != client.outbox.end() && count < MAX_IOV; ++it, ++count)
+            {
+                size_t skip = count == 0 ? client.outboxHead : 0;
+                iov[count].iov_base = const_cast<char *>((*it)->data() + skip);
+                iov[count].iov_len = (*it)->size() - skip;
+                wanted += iov[count].iov_len;
+            }
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            ssize_t n = sendmsg(client.socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break; // the owning loop resumes on EPOLLOUT
+            if (n <= 0)
+                return false;
+
+            Metrics::add(Metrics::SendCalls);
+            Metrics::add(Metrics::BytesOut, n);
+            client.outboxBytes -= static_cast<size_t>(n);
+            for (size_t left = static_cast<size_t>(n); left > 0;)
+            {
+                size_t rest = client.outbox.front()->size() - client.outboxHead;
+                if (left < rest)
+                {
+                    client.outboxHead += left;
+                    break;
+                }
+                left -= rest;
+                client.outbox.pop_front();
+                client.outboxHead = 0;
+            }
+            if (static_cast<size_t>(n) < wanted)
+                break; // the socket buffer is full, another call would only see EAGAIN
         }
+        if (client.slow && client.outboxBytes <= config.queueLowWatermark)
+            client.slow = false;
+        return true;
+    }
+
+    bool flushOutbox(ClientInfo &client)
+    {
+        lock_guard<mutex> lock(client.writeMutex);
+        if (client.closed)
+            return true;
+        return writeOutboxLocked(client);
+    }
+
+    // Only the owner of a socket closes it; writers check `closed` under writeMutex,
+    // so a recycled descriptor number can never receive another client's bytes.
+    // Output the current tick queued (a rejection, a kick notice) gets one
+    // last non-blocking write first.
+    void closeClient(ClientInfo &client)
+    {
+        lock_guard<mutex> lock(client.writeMutex);
+        if (client.closed)
+            return;
+        if (!client.outbox.empty())
+            writeOutboxLocked(client);
+        client.closed = true;
+        client.outbox.clear();
+        client.outboxBytes = client.outboxHead = 0;
+        close(client.socket);
+        Metrics::add(Metrics::ConnectionsClosed);
     }
 
     static string nowTimestamp()
@@ -196,7 +668,8 @@ private:
         string cmd;
         while (running)
         {
-            getline(cin, cmd);
+            if (!getline(cin, cmd))
+                break; // stdin closed: no console, keep serving
             if (!running)
                 break;
 
@@ -208,655 +681,2272 @@ private:
             else if (cmd.rfind("say ", 0) == 0)
             {
                 string msg = "[SERVER] " + cmd.substr(4);
-                broadcastMessage(msg, -1, "general");
+                runOnRoomOwner("general", [this, msg] { broadcastMessage(msg, nullptr, "general"); });
             }
             else if (cmd.rfind("slowmode ", 0) == 0)
             {
-                // slowmode <room> <seconds>
+                // slowmode <room> <seconds> [<duration>]
                 istringstream iss(cmd.substr(9));
-                string room; int seconds = 0;
+                string room; int seconds = 0, duration = 0;
                 if (iss >> room >> seconds)
                 {
-                    {
-                        lock_guard<mutex> lock(clientsMutex);
-                        roomSlowmodeSeconds[room] = max(0, seconds);
-                    }
-                    string notice = "[SERVER] Slowmode for room '" + room + "' set to " + to_string(seconds) + "s";
-                    broadcastMessage(notice, -1, room);
-                    cout << notice << endl;
+                    iss >> duration;
+                    IoLoop &loop = housekeepingLoop();
+                    postToLoop(loop, [this, &loop, room, seconds, duration] { setSlowmode(loop, room, seconds, duration); });
                 }
                 else
                 {
-                    cout << "Usage: slowmode <room> <seconds>" << endl;
+                    cout << "Usage: slowmode <room> <seconds> [<duration>]" << endl;
                 }
             }
+            else if (cmd == "ratelimit" || cmd.rfind("ratelimit ", 0) == 0)
+            {
+                rateLimitCommand(cmd.size() > 10 ? cmd.substr(10) : "");
+            }
             else if (cmd == "list")
             {
-                lock_guard<mutex> lock(clientsMutex);
                 cout << COLOR_CYAN << "\n╔═══ Connected Users ═══╗" << COLOR_RESET << endl;
-                for (auto &c : clients)
-                    cout << COLOR_GREEN << "  • " << COLOR_RESET << c.name 
-                         << COLOR_YELLOW << " (" << c.addr << ")" << COLOR_RESET
-                         << COLOR_BLUE << " room=" << c.room << COLOR_RESET << endl;
+                registry.forEachSession([](const shared_ptr<ClientInfo> &c) {
+                    cout << COLOR_GREEN << "  • " << COLOR_RESET << c->name 
+                         << COLOR_YELLOW << " (" << c->addr << ")" << COLOR_RESET
+                         << COLOR_BLUE << " room=" << c->room << COLOR_RESET << endl;
+                });
+                cout << COLOR_CYAN << "╚═══════════════════════╝\n" << COLOR_RESET << endl;
+            }
+            else if (cmd == "queues")
+            {
+                int slowNow = 0;
+                size_t queuedBytes = 0;
+                registry.forEachSession([&](const shared_ptr<ClientInfo> &c) {
+                    lock_guard<mutex> wlock(c->writeMutex);
+                    slowNow += c->slow;
+                    queuedBytes += c->outboxBytes;
+                });
+                cout << COLOR_CYAN << "\n╔═══ Outbound Queues ═══╗" << COLOR_RESET << endl;
+                cout << "  watermarks: high=" << config.queueHighWatermark << "B low=" << config.queueLowWatermark
+                     << "B policy=" << slowPolicyName(config.slowPolicy) << endl;
+                cout << "  queued now: " << queuedBytes << "B, slow clients: " << slowNow << endl;
+                cout << "  dropped oldest: " << slowDroppedOldest << ", dropped new: " << slowDroppedNew
+                     << ", disconnected: " << slowDisconnects << endl;
                 cout << COLOR_CYAN << "╚═══════════════════════╝\n" << COLOR_RESET << endl;
             }
+            else if (cmd == "history")
+            {
+                RoomCache::Stats cache = recent.stats();
+                cout << COLOR_CYAN << "\n╔═══ History ═══╗" << COLOR_RESET << endl;
+                cout << "  written: " << history.linesWritten() << " lines in " << history.batchesWritten()
+                     << " batches, syncs: " << history.syncCount() << ", write errors: " << history.writeErrors() << endl;
+                cout << "  cache: " << cache.rooms << " rooms, " << cache.bytesReserved << "B reserved, hits: "
+                     << cache.hits << ", misses: " << cache.misses << ", evictions: " << cache.evictions << endl;
+                cout << COLOR_CYAN << "╚═══════════════╝\n" << COLOR_RESET << endl;
+            }
+            else if (cmd == "stats")
+            {
+                printStats();
+            }
+            else if (cmd == "workers")
+            {
+                printWorkers();
+            }
+            else if (cmd == "trace" || cmd.rfind("trace ", 0) == 0)
+            {
+                traceCommand(cmd.size() > 6 ? cmd.substr(6) : "");
+            }
             else if (cmd == "help")
             {
                 cout << COLOR_MAGENTA << "\n╔═══ Admin Commands ═══╗" << COLOR_RESET << endl;
                 cout << COLOR_YELLOW << "  kick <username>" << COLOR_RESET << "       - Kick a user\n";
                 cout << COLOR_YELLOW << "  say <message>" << COLOR_RESET << "         - Broadcast to general room\n";
-                cout << COLOR_YELLOW << "  slowmode <room> <sec>" << COLOR_RESET << " - Set room slowmode\n";
+                cout << COLOR_YELLOW << "  slowmode <room> <sec> [dur]" << COLOR_RESET << " - Set room slowmode, lifted after dur seconds if given\n";
+                cout << COLOR_YELLOW << "  ratelimit [room] <rate> <burst>" << COLOR_RESET << " - Messages/sec per user, globally or for a room\n";
+                cout << COLOR_YELLOW << "  ratelimit <room> default" << COLOR_RESET << " - Drop a room's own rate limit\n";
                 cout << COLOR_YELLOW << "  list" << COLOR_RESET << "                  - List online users\n";
+                cout << COLOR_YELLOW << "  queues" << COLOR_RESET << "                - Outbound queue / slow consumer stats\n";
+                cout << COLOR_YELLOW << "  history" << COLOR_RESET << "               - History writer and cache stats\n";
+                cout << COLOR_YELLOW << "  stats" << COLOR_RESET << "                 - Traffic, rejections and latency metrics\n";
+                cout << COLOR_YELLOW << "  workers" << COLOR_RESET << "               - Rooms and members per I/O thread (epoll mode)\n";
+                cout << COLOR_YELLOW << "  trace on [N] | off" << COLOR_RESET << "    - Trace one message in N per thread (default 100)\n";
+                cout << COLOR_YELLOW << "  trace dump [file]" << COLOR_RESET << "     - Write traces as Chrome JSON (default trace.json)\n";
+                cout << COLOR_YELLOW << "  trace clear" << COLOR_RESET << "           - Drop buffered traces\n";
                 cout << COLOR_YELLOW << "  help" << COLOR_RESET << "                  - Show this help\n";
                 cout << COLOR_MAGENTA << "╚═══════════════════════╝\n" << COLOR_RESET << endl;
             }
         }
     }
 
-    void saveMessage(const string &room, const string &message)
+    void printStats()
     {
-        ensureHistoryDir();
-        ofstream file("history/history_" + room + ".txt", ios::app);
-        if (file.is_open())
-            file << message << endl;
+        Metrics::Snapshot m = Metrics::collect();
+        auto latency = [](const Metrics::HistogramCounts &h) {
+            ostringstream out;
+            out << h.count << " samples, avg " << (h.count ? h.sumNs / h.count / 1000 : 0) << "us, p50 <= "
+                << h.quantileUs(0.5) << "us, p99 <= " << h.quantileUs(0.99) << "us";
+            return out.str();
+        };
+        cout << COLOR_CYAN << "\n╔═══ Stats ═══╗" << COLOR_RESET << endl;
+        cout << "  connections: " << m.counters[Metrics::ConnectionsOpened] - m.counters[Metrics::ConnectionsClosed]
+             << " open, " << m.counters[Metrics::ConnectionsOpened] << " opened, "
+             << m.counters[Metrics::ConnectionsClosed] << " closed (" << m.counters[Metrics::TimedOut] << " timed out, "
+             << m.counters[Metrics::ConnectionsShed] << " shed)"
+             << endl;
+        cout << "  bytes: " << m.counters[Metrics::BytesIn] << " in, " << m.counters[Metrics::BytesOut] << " out" << endl;
+        cout << "  rejected: " << m.counters[Metrics::RateLimited] << " rate limited, "
+             << m.counters[Metrics::SlowmodeRejected] << " slowmode" << endl;
+        cout << "  presence: " << m.counters[Metrics::PresenceEvents] << " joins/leaves in "
+             << m.counters[Metrics::PresenceLines] << " lines" << endl;
+        cout << "  user ids: " << userIds.size() << " names held by sessions and blocklists" << endl;
+        cout << "  broadcast: " << latency(m.histograms[Metrics::BroadcastFanout]) << endl;
+        cout << "  history write: " << latency(m.histograms[Metrics::HistoryWrite]) << endl;
+        for (auto &room : m.rooms)
+            cout << COLOR_BLUE << "  #" << room.first << COLOR_RESET << ": " << room.second.messagesIn << " in, "
+                 << room.second.messagesOut << " out" << endl;
+        cout << COLOR_CYAN << "╚═════════════╝\n" << COLOR_RESET << endl;
     }
 
-    void sendRoomHistory(int clientSocket, const string &room)
+    void printWorkers()
     {
-        ensureHistoryDir();
-        ifstream file("history/history_" + room + ".txt");
-        if (!file.is_open())
-            return;
-        string line;
-        string header = "---- Chat History for room '" + room + "' ----\n";
-        sendAll(clientSocket, header.c_str(), header.size());
-        while (getline(file, line))
+        if (scheduler.workers() == 0)
         {
-            sendAll(clientSocket, line.c_str(), line.size());
-            sendAll(clientSocket, "\n", 1);
+            cout << "Room placement only applies in epoll mode" << endl;
+            return;
         }
-        string footer = "-------------------------------------------\n";
-        sendAll(clientSocket, footer.c_str(), footer.size());
+        vector<size_t> rooms, members;
+        scheduler.snapshot(rooms, members);
+        Metrics::Snapshot m = Metrics::collect();
+        cout << COLOR_CYAN << "\n╔═══ Workers ═══╗" << COLOR_RESET << endl;
+        for (size_t w = 0; w < rooms.size(); ++w)
+            cout << "  I/O thread " << w << ": " << rooms[w] << " rooms, " << members[w] << " members" << endl;
+        cout << "  migrations: " << m.counters[Metrics::SessionMigrations] << " sessions, "
+             << m.counters[Metrics::RoomMoves] << " room moves" << endl;
+        cout << COLOR_CYAN << "╚═══════════════╝\n" << COLOR_RESET << endl;
     }
 
-    bool isRateLimited(int clientSocket)
+    // trace [on [N] | off | dump [file] | clear]
+    void traceCommand(const string &args)
     {
-        lock_guard<mutex> lock(clientsMutex);
-
-        for (auto &c : clients)
+        istringstream iss(args);
+        string action, arg;
+        iss >> action >> arg;
+        if (action == "on")
         {
-            if (c.socket == clientSocket)
+            unsigned long every = 100;
+            if (!arg.empty())
             {
-                auto now = chrono::steady_clock::now();
-                auto diff = chrono::duration_cast<chrono::milliseconds>(now - c.lastMsgTime).count();
-
-                if (diff > 1000)
+                auto [end, ec] = from_chars(arg.data(), arg.data() + arg.size(), every);
+                if (ec != errc() || end != arg.data() + arg.size() || every == 0 || every > UINT32_MAX)
                 {
-                    c.msgCount = 0;
-                    c.lastMsgTime = now;
+                    cout << "Usage: trace on [N]  (N >= 1)" << endl;
+                    return;
                 }
-
-                c.msgCount++;
-
-                if (c.msgCount > 3)
-                    return true;
-                return false;
             }
+            Trace::setSampling(static_cast<uint32_t>(every));
+            cout << COLOR_GREEN << "✓ Tracing one message in " << every << " per thread" << COLOR_RESET << endl;
         }
-        return false;
-    }
-
-    void handleClient(int clientSocket, string addrStr)
-    {
-        const int USERNAME_MAX = 64;
-        char nameBuf[USERNAME_MAX]{};
-        ssize_t r = recv(clientSocket, nameBuf, sizeof(nameBuf) - 1, 0);
-        if (r <= 0)
+        else if (action == "off")
         {
-            close(clientSocket);
-            return;
+            Trace::setSampling(0);
+            cout << COLOR_GREEN << "✓ Tracing off, " << Trace::bufferedEvents() << " events kept for dump" << COLOR_RESET << endl;
+        }
+        else if (action == "dump")
+        {
+            string path = arg.empty() ? "trace.json" : arg;
+            ofstream out(path);
+            size_t events = out ? Trace::dumpChromeJson(out) : 0;
+            if (!out)
+            {
+                cout << COLOR_RED << "⚠ Cannot write " << path << COLOR_RESET << endl;
+                return;
+            }
+            cout << COLOR_GREEN << "✓ Wrote " << events << " events to " << path << COLOR_RESET << endl;
+        }
+        else if (action == "clear")
+        {
+            Trace::clear();
+            cout << COLOR_GREEN << "✓ Trace buffers cleared" << COLOR_RESET << endl;
+        }
+        else if (action.empty())
+        {
+            uint32_t every = Trace::sampling();
+            cout << "Tracing " << (every ? "one message in " + to_string(every) : string("off")) << ", "
+                 << Trace::bufferedEvents() << " events buffered" << endl;
+        }
+        else
+        {
+            cout << "Usage: trace [on [N] | off | dump [file] | clear]" << endl;
         }
+    }
 
-        nameBuf[USERNAME_MAX - 1] = '\0'; // Ensure null termination
-        string username(nameBuf);
-        while (!username.empty() && (username.back() == '\n' || username.back() == '\r'))
-            username.pop_back();
-        if (username.empty())
-            username = "Anonymous";
-        
-        // Truncate username if too long (safety check)
-        if (username.length() > 63)
-            username = username.substr(0, 63);
+    // The merged metrics plus gauges read from the server's own state
+    string metricsText()
+    {
+        string out;
+        Metrics::appendPrometheus(out, Metrics::collect());
+        RoomCache::Stats cache = recent.stats();
+        size_t rooms = 0;
+        registry.forEachRoom([&rooms](const string &, size_t) { ++rooms; });
+        const pair<const char *, uint64_t> gauges[] = {
+            {"opticom_rooms", rooms},
+            {"opticom_cache_rooms", cache.rooms},
+            {"opticom_cache_bytes_reserved", cache.bytesReserved},
+        };
+        const pair<const char *, uint64_t> counters[] = {
+            {"opticom_history_lines_written_total", history.linesWritten()},
+            {"opticom_history_syncs_total", history.syncCount()},
+            {"opticom_history_write_errors_total", history.writeErrors()},
+            {"opticom_cache_hits_total", cache.hits},
+            {"opticom_cache_misses_total", cache.misses},
+            {"opticom_cache_evictions_total", cache.evictions},
+            {"opticom_slow_dropped_oldest_total", slowDroppedOldest.load()},
+            {"opticom_slow_dropped_new_total", slowDroppedNew.load()},
+            {"opticom_slow_disconnects_total", slowDisconnects.load()},
+        };
+        for (auto &g : gauges)
+            out += string("# TYPE ") + g.first + " gauge\n" + g.first + " " + to_string(g.second) + "\n";
+        for (auto &c : counters)
+            out += string("# TYPE ") + c.first + " counter\n" + c.first + " " + to_string(c.second) + "\n";
+        return out;
+    }
 
+    // Loopback only: the numbers are for the operator, not the internet
+    int openMetricsListener()
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            throw runtime_error("Failed to create metrics socket");
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(config.metricsPort);
+        if (::bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
         {
-            lock_guard<mutex> lock(clientsMutex);
-            clients.push_back({clientSocket, username, addrStr, "general"});
+            close(fd);
+            throw runtime_error("Failed to bind metrics port " + to_string(config.metricsPort));
         }
+        return fd;
+    }
 
-        string joinMsg = "[" + nowTimestamp() + "] " + username + " joined the chat (room: general)";
-        cout << COLOR_GREEN << "→ " << COLOR_RESET << joinMsg << endl;
-        broadcastMessage(joinMsg, clientSocket, "general");
-        saveMessage("general", joinMsg);
-        sendRoomHistory(clientSocket, "general");
-
-        char buffer[1024];
+    // One scrape at a time is plenty; a stalled scraper times out after a second
+    void metricsLoop(int listenFd)
+    {
         while (running)
         {
-            memset(buffer, 0, sizeof(buffer));
-            ssize_t bytes = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-
-            if (bytes <= 0)
-            {
-                close(clientSocket);
-                removeClient(clientSocket);
-                string leftMsg = "[" + nowTimestamp() + "] " + username + " left the chat";
-                cout << COLOR_RED << "← " << COLOR_RESET << leftMsg << endl;
-                broadcastMessage(leftMsg, -1, "general");
-                saveMessage("general", leftMsg);
-                break;
-            }
-
-            // Decrypt received message
-            string encrypted(buffer, buffer + bytes);
-            string msg = Encryption::decrypt(encrypted);
-            
-            while (!msg.empty() && (msg.back() == '\n' || msg.back() == '\r'))
-                msg.pop_back();
-            if (msg.empty())
-                continue;
-
-            if (msg == "/rooms")
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0)
             {
-                lock_guard<mutex> lock(clientsMutex);
-
-                unordered_map<string, int> roomCount;
-                for (auto &c : clients)
-                {
-                    roomCount[c.room]++;
-                }
-
-                string out = "Active Rooms:\n";
-                for (auto &r : roomCount)
-                {
-                    out += " - " + r.first + " (" + to_string(r.second) + " users)\n";
-                }
-
-                sendAll(clientSocket, out.c_str(), out.size());
-                continue;
-            }
-
-            if (msg == "/help")
-            {
-                string help =
-                    "Available Commands:\n"
-                    "/list               - List online users\n"
-                    "/rooms              - List all active rooms\n"
-                    "/join <room>        - Join or create a room\n"
-                    "/pm <user> <msg>    - Private message\n"
-                    "/block <user>       - Block messages from a user\n"
-                    "/unblock <user>     - Unblock a user\n"
-                    "/blocklist          - Show your blocked users\n"
-                    "/pin <msg>          - Pin a message to the room board\n"
-                    "/pins               - Show pinned messages for the room\n"
-                    "/unpin <index>      - Remove a pinned message by index\n"
-                    "/quit               - Disconnect from server\n"
-                    "/help               - Show this help\n";
-
-                help += "\n"; // <- IMPORTANT: ensures it prints immediately
-                sendAll(clientSocket, help.c_str(), help.size());
+                if (!running)
+                    break; // shut down by stop()
+                if (errno != EINTR && errno != ECONNABORTED)
+                    this_thread::sleep_for(chrono::milliseconds(100)); // out of descriptors, say
                 continue;
             }
+            timeval timeout{1, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
-            if (msg == "/list")
+            string request;
+            char buffer[1024];
+            while (request.find("\r\n\r\n") == string::npos && request.size() < 8192)
             {
-                string listMsg = "Online users:\n";
-                lock_guard<mutex> lock(clientsMutex);
-                for (auto &c : clients)
-                    listMsg += " - " + c.name + " (room: " + c.room + ")\n";
-                sendAll(clientSocket, listMsg.c_str(), listMsg.size());
-                continue;
+                ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+                if (n <= 0)
+                    break;
+                request.append(buffer, n);
             }
-
-            if (msg.rfind("/join ", 0) == 0)
+            bool found = request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET / ", 0) == 0;
+            string body = found ? metricsText() : "Not found\n";
+            string response = string(found ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 404 Not Found\r\n") +
+                              "Content-Type: text/plain; version=0.0.4\r\nContent-Length: " + to_string(body.size()) +
+                              "\r\nConnection: close\r\n\r\n" + body;
+            for (size_t sent = 0; sent < response.size();)
             {
-                string newRoom = msg.substr(6);
-                if (newRoom.empty())
-                    newRoom = "general";
-
-                string oldRoom;
-
-                {
-                    lock_guard<mutex> lock(clientsMutex);
-                    for (auto &c : clients)
-                    {
-                        if (c.socket == clientSocket)
-                        {
-                            oldRoom = c.room;
-                        }
-                    }
-                }
+                ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (n <= 0)
+                    break;
+                sent += n;
+            }
+            close(fd);
+        }
+        close(listenFd);
+    }
 
-                if (oldRoom != newRoom)
-                {
+    static const char *slowPolicyName(SlowConsumerPolicy policy)
+    {
+        switch (policy)
+        {
+        case SlowConsumerPolicy::DropOldest: return "drop-oldest";
+        case SlowConsumerPolicy::DropNew: return "drop-new";
+        case SlowConsumerPolicy::Disconnect: return "disconnect";
+        }
+        return "?";
+    }
 
-                    string leftMsg = "[" + nowTimestamp() + "] " + username + " left room " + oldRoom;
-                    broadcastMessage(leftMsg, clientSocket, oldRoom);
-                    saveMessage(oldRoom, leftMsg);
+    void saveMessage(const string &room, const string &message)
+    {
+        {
+            Trace::Span span("cache_append");
+            recent.append(room, message);
+        }
+        Trace::Span span("history_enqueue");
+        history.append(room, message);
+    }
 
+    // Served from the room's ring once it is seeded, which is pure memory work
+    // during join storms. Otherwise (the first join or message since the room
+    // was last cached starts the seeding) the replay runs on the history
+    // thread behind every line queued before it, so it still includes the
+    // client's own join and never blocks the caller on the disk.
+    void sendRoomHistory(const shared_ptr<ClientInfo> &client, const string &room)
+    {
+        Trace::Span span("history_replay");
+        bool framed = client->protocol == ClientInfo::Protocol::Framed;
+        bool cached = false;
+        Payload replay = buildReplay(room, framed, [&](auto &&visit) {
+            cached = recent.forEachRecent(room, config.historyReplay, visit);
+        });
+        if (!cached)
+        {
+            history.post([this, client, room] { replayHistory(client, room); });
+            return;
+        }
+        if (replay)
+            sendPayload(*client, replay);
+    }
+
+    // Runs on the history thread: the last N messages come straight out of the
+    // mmap'd segments, and the session's own loop sends them
+    void replayHistory(const shared_ptr<ClientInfo> &client, const string &room)
+    {
+        bool framed = client->protocol == ClientInfo::Protocol::Framed;
+        Payload replay = buildReplay(room, framed, [&](auto &&visit) {
+            history.forEachRecent(room, config.historyReplay, visit);
+        });
+        if (replay)
+            runOnOwner(client, [this, client, replay] { sendPayload(*client, replay); });
+    }
+
+    // Runs on the history thread, where the posted seed sits right behind the
+    // lines that were queued before ring `id` existed
+    void seedRecent(const string &room, uint64_t id)
+    {
+        vector<string> stored;
+        history.forEachRecent(room, config.historyReplay,
+                              [&stored](const char *line, size_t len) { stored.emplace_back(line, len); });
+        recent.seed(room, id, stored);
+    }
+
+    // Header, the lines `source` visits, footer: one buffer the socket takes in
+    // a single write. Null when there is nothing to replay.
+    template <typename Source>
+    static Payload buildReplay(const string &room, bool framed, Source &&source)
+    {
+        string header = "---- Chat History for room '" + room + "' ----\n";
+        string footer = "-------------------------------------------\n";
+        auto out = make_shared<string>();
+        appendEncoded(*out, header.data(), header.size(), framed, false);
+        size_t replayed = 0;
+        source([&](const char *line, size_t len) {
+            appendEncoded(*out, line, len, framed, true);
+            ++replayed;
+        });
+        if (replayed == 0)
+            return nullptr;
+        appendEncoded(*out, footer.data(), footer.size(), framed, false);
+        return out;
+    }
+
+    // Appends text in the client's wire format to a buffer of several messages:
+    // one frame each for framed clients, the packets the legacy path would
+    // have sent (newline encrypted separately) for the others
+    static void appendEncoded(string &out, const char *text, size_t len, bool framed, bool newline)
+    {
+        if (framed)
+        {
+            Framing::appendHeader(out, Framing::FrameType::Text, len + (newline ? 1 : 0));
+            size_t start = out.size();
+            out.append(text, len);
+            if (newline)
+                out.push_back('\n');
+            Encryption::applyInPlace(&out[start], out.size() - start);
+            return;
+        }
+        size_t start = out.size();
+        out.append(text, len);
+        Encryption::applyInPlace(&out[start], len);
+        if (newline)
+        {
+            out.push_back('\n');
+            Encryption::applyInPlace(&out.back(), 1);
+        }
+    }
+
+    // Copy-on-write edit of one room's rules; entries back at the defaults are dropped
+    template <typename Edit>
+    void updateRoomRules(const string &room, Edit &&edit)
+    {
+        rules.update([&](ChatRules &r) {
+            RoomRules &roomRules = r.rooms[room];
+            edit(roomRules);
+            if (roomRules.slowmodeSeconds == 0 && !roomRules.ownRate)
+                r.rooms.erase(room);
+        });
+    }
+
+    // Runs on the housekeeping loop, which keeps every room's end-of-slowmode
+    // timer, so a newer setting always replaces the expiry of an older one
+    void setSlowmode(IoLoop &loop, const string &room, int seconds, int duration)
+    {
+        seconds = max(0, seconds);
+        updateRoomRules(room, [seconds](RoomRules &r) { r.slowmodeSeconds = seconds; });
+        string notice = "[SERVER] Slowmode for room '" + room + "' set to " + to_string(seconds) + "s";
+        if (seconds > 0 && duration > 0)
+            notice += " for " + to_string(duration) + "s";
+        runOnRoomOwner(room, [this, notice, room] { broadcastMessage(notice, nullptr, room); });
+        cout << notice << endl;
+
+        auto &end = slowmodeEnds[room];
+        if (!end)
+            end = make_unique<TimerWheel::Timer>([this, room] { endSlowmode(room); });
+        if (seconds > 0 && duration > 0)
+            loop.timers.schedule(*end, loop.now + duration * NS_PER_SECOND);
+        else
+            loop.timers.cancel(*end);
+    }
+
+    void endSlowmode(const string &room)
+    {
+        updateRoomRules(room, [](RoomRules &r) { r.slowmodeSeconds = 0; });
+        string notice = "[SERVER] Slowmode for room '" + room + "' has ended";
+        runOnRoomOwner(room, [this, notice, room] { broadcastMessage(notice, nullptr, room); });
+        cout << notice << endl;
+    }
+
+    // Where timers that belong to no session live
+    IoLoop &housekeepingLoop()
+    {
+        return outputLoop ? *outputLoop : *ioLoops[0];
+    }
+
+    static string describeRate(const RateLimit &limit)
+    {
+        if (limit.unlimited())
+            return "unlimited";
+        ostringstream out;
+        out << limit.perSecond << " msg/s, burst " << limit.burst;
+        return out.str();
+    }
+
+    // ratelimit                       show the limits
+    // ratelimit <rate> <burst>        global limit (rate 0 = unlimited)
+    // ratelimit <room> <rate> <burst> limit for one room
+    // ratelimit <room> default        room goes back to the global limit
+    void rateLimitCommand(const string &args)
+    {
+        istringstream iss(args);
+        vector<string> words;
+        for (string w; iss >> w;)
+            words.push_back(w);
+
+        auto parseLimit = [](const string &rate, const string &burst, RateLimit &out) {
+            try {
+                out.perSecond = stod(rate);
+                out.burst = stod(burst);
+            } catch (...) {
+                return false;
+            }
+            return out.burst >= 1;
+        };
+
+        RateLimit limit;
+        if (words.empty())
+        {
+            Epoch::Guard guard;
+            const ChatRules *r = rules.load();
+            cout << "  global: " << describeRate(r->rate) << endl;
+            for (auto &entry : r->rooms)
+            {
+                cout << "  " << entry.first << ": " << (entry.second.ownRate ? describeRate(entry.second.rate) : "global rate");
+                if (entry.second.slowmodeSeconds > 0)
+                    cout << ", slowmode " << entry.second.slowmodeSeconds << "s";
+                cout << endl;
+            }
+        }
+        else if (words.size() == 2 && words[1] == "default")
+        {
+            updateRoomRules(words[0], [](RoomRules &r) { r.ownRate = false; });
+            cout << "Room '" << words[0] << "' uses the global rate limit" << endl;
+        }
+        else if (words.size() == 2 && parseLimit(words[0], words[1], limit))
+        {
+            rules.update([&limit](ChatRules &r) { r.rate = limit; });
+            cout << "Global rate limit: " << describeRate(limit) << endl;
+        }
+        else if (words.size() == 3 && parseLimit(words[1], words[2], limit))
+        {
+            updateRoomRules(words[0], [&limit](RoomRules &r) {
+                r.ownRate = true;
+                r.rate = limit;
+            });
+            string notice = "[SERVER] Rate limit for room '" + words[0] + "' set to " + describeRate(limit);
+            runOnRoomOwner(words[0], [this, notice, room = words[0]] { broadcastMessage(notice, nullptr, room); });
+            cout << notice << endl;
+        }
+        else
+        {
+            cout << "Usage: ratelimit [<room>] <msgs/sec> <burst> | ratelimit <room> default" << endl;
+        }
+    }
+
+    // Thread-per-client mode: one blocking handler thread per connection
+    void handleClient(int clientSocket, string addrStr)
+    {
+        auto client = make_shared<ClientInfo>(clientSocket, "", addrStr, "general");
+        postToLoop(*outputLoop, [this, client] { adoptClient(*outputLoop, client); });
+
+        if (detectProtocol(*client) && client->protocol == ClientInfo::Protocol::Framed)
+        {
+            while (running && readIntoInbox(*client) > 0)
+            {
+                OutputBatch batch(*this); // whatever this read causes goes out once per connection
+                if (!processFrames(client))
+                    break;
+            }
+        }
+        else if (client->protocol == ClientInfo::Protocol::Text)
+        {
+            const int USERNAME_MAX = 64;
+            char nameBuf[USERNAME_MAX]{};
+            ssize_t r = recv(clientSocket, nameBuf, sizeof(nameBuf) - 1, 0);
+            if (r > 0)
+            {
+                Metrics::add(Metrics::BytesIn, r);
+                heardFrom(*client);
+            }
+            if (r > 0 && !completeHandshake(client, string(nameBuf, r)))
+                r = 0;
+
+            char buffer[1024];
+            while (r > 0 && running)
+            {
+                ssize_t bytes = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
+                if (bytes <= 0)
+                    break;
+                Metrics::add(Metrics::BytesIn, bytes);
+                heardFrom(*client);
+                Encryption::applyInPlace(buffer, bytes);
+                OutputBatch batch(*this);
+                handleMessage(client, string(buffer, buffer + bytes));
+            }
+        }
+        handleDisconnect(client); // closes the socket, which also drops it from the output loop's epoll set
+        postToLoop(*outputLoop, [this, client] { releaseClient(*outputLoop, client); });
+    }
+
+    // Reactor mode: a small fixed pool of epoll loops replaces the per-client threads
+    void startIoLoops(bool ownListeners)
+    {
+        raiseFileLimit();
+        int count = max(1, config.ioThreads);
+        for (int i = 0; i < count; ++i)
+        {
+            auto loop = make_unique<IoLoop>();
+            loop->index = i;
+            loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+            loop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (loop->epollFd < 0 || loop->wakeFd < 0)
+                throw runtime_error("Failed to create epoll instance");
+
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.ptr = loop.get(); // the loop itself tags its wakeup descriptor
+            if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &ev) < 0)
+                throw runtime_error("Failed to register eventfd with epoll");
+            ioLoops.push_back(move(loop));
+        }
+
+        // With SO_REUSEPORT each listener lives on its own loop and accepts there
+        for (size_t i = 0; ownListeners && i < listenSockets.size(); ++i)
+        {
+            IoLoop &loop = *ioLoops[i % ioLoops.size()];
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.ptr = listenSockets[i].get();
+            if (epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, *listenSockets[i], &ev) < 0)
+                throw runtime_error("Failed to register listener with epoll");
+            loop.listeners.push_back(listenSockets[i].get());
+        }
+        for (auto &loop : ioLoops)
+        {
+            IoLoop *raw = loop.get();
+            loop->acceptResume.setCallback([raw] { watchListeners(*raw, EPOLLIN); });
+        }
+        for (auto &loop : ioLoops)
+            thread(&ChatServer::runIoLoop, this, loop.get()).detach();
+    }
+
+    // Events 0 parks the loop's listeners without taking them out of epoll
+    static void watchListeners(IoLoop &loop, uint32_t events)
+    {
+        for (int *listener : loop.listeners)
+        {
+            epoll_event ev{};
+            ev.events = events;
+            ev.data.ptr = listener;
+            epoll_ctl(loop.epollFd, EPOLL_CTL_MOD, *listener, &ev);
+        }
+    }
+
+    // 50k idle connections need far more descriptors than the usual soft limit
+    static void raiseFileLimit()
+    {
+        rlimit rl{};
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+        {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
+
+    // Thread mode keeps blocking reads in the handler threads; one extra loop
+    // watches their sockets for EPOLLOUT and drains whatever sendAll left queued
+    void startOutputLoop()
+    {
+        outputLoop = make_unique<IoLoop>();
+        outputLoop->writeOnly = true;
+        outputLoop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        outputLoop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (outputLoop->epollFd < 0 || outputLoop->wakeFd < 0)
+            throw runtime_error("Failed to create epoll instance");
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = outputLoop.get();
+        if (epoll_ctl(outputLoop->epollFd, EPOLL_CTL_ADD, outputLoop->wakeFd, &ev) < 0)
+            throw runtime_error("Failed to register eventfd with epoll");
+        thread(&ChatServer::runIoLoop, this, outputLoop.get()).detach();
+    }
+
+    // Runs `task` on the loop's thread
+    void postToLoop(IoLoop &loop, function<void()> task)
+    {
+        {
+            lock_guard<mutex> lock(loop.tasksMutex);
+            loop.tasks.push_back(move(task));
+        }
+        uint64_t one = 1;
+        ssize_t w = write(loop.wakeFd, &one, sizeof(one));
+        (void)w;
+    }
+
+    void runPostedTasks(IoLoop &loop)
+    {
+        uint64_t count;
+        ssize_t r = read(loop.wakeFd, &count, sizeof(count));
+        (void)r;
+
+        vector<function<void()>> batch;
+        {
+            lock_guard<mutex> lock(loop.tasksMutex);
+            batch.swap(loop.tasks);
+        }
+        for (auto &task : batch)
+            task();
+    }
+
+    // Hands an accepted socket to the next I/O loop (round robin)
+    void dispatchToLoop(const shared_ptr<ClientInfo> &client)
+    {
+        IoLoop &loop = *ioLoops[nextLoop++ % ioLoops.size()];
+        client->loop = &loop;
+        postToLoop(loop, [this, &loop, client] { adoptClient(loop, client); });
+    }
+
+    // Must run on the loop's own thread. False if the socket could not be
+    // watched; a reactor loop has closed it then.
+    bool adoptClient(IoLoop &loop, const shared_ptr<ClientInfo> &client)
+    {
+        epoll_event ev{};
+        ev.events = loop.writeOnly ? EPOLLOUT | EPOLLET : EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = client.get();
+        bool registered;
+        {
+            // Holding writeMutex keeps the owner from closing (and the number being reused) meanwhile
+            lock_guard<mutex> lock(client->writeMutex);
+            if (client->closed)
+                return false;
+            registered = epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, client->socket, &ev) == 0;
+        }
+        if (!registered)
+        {
+            if (!loop.writeOnly)
+                closeClient(*client);
+            return false;
+        }
+        if (!loop.writeOnly)
+            client->loop = &loop;
+        auto &slot = loop.conns[client->socket];
+        if (slot)
+        {
+            loop.timers.cancel(slot->timer);
+            loop.closing.push_back(slot); // stale entry for a recycled descriptor
+        }
+        slot = client;
+        ClientInfo *raw = client.get();
+        client->timer.setCallback([this, &loop, raw] { checkDeadlines(loop, raw); });
+        armDeadline(loop, *client);
+        return true;
+    }
+
+    // Must run on the loop's own thread; the client's socket may already be closed
+    void releaseClient(IoLoop &loop, const shared_ptr<ClientInfo> &client)
+    {
+        auto it = loop.conns.find(client->socket);
+        if (it == loop.conns.end() || it->second != client)
+            return;
+        loop.timers.cancel(client->timer);
+        loop.closing.push_back(it->second);
+        loop.conns.erase(it);
+    }
+
+    // Must run on the loop's own thread, for a peer that is gone
+    void dropClient(IoLoop &loop, const shared_ptr<ClientInfo> &client)
+    {
+        {
+            lock_guard<mutex> lock(client->writeMutex);
+            if (!client->closed)
+                epoll_ctl(loop.epollFd, EPOLL_CTL_DEL, client->socket, nullptr);
+        }
+        releaseClient(loop, client);
+        handleDisconnect(client);
+    }
+
+    // When the session's timer should next look at it: the handshake deadline,
+    // else the idle deadline or the next keepalive check, whichever comes first
+    void armDeadline(IoLoop &loop, ClientInfo &client)
+    {
+        int64_t deadline = INT64_MAX;
+        if (client.state == ClientInfo::State::Handshake && config.handshakeTimeout > 0)
+            deadline = client.acceptedNs + config.handshakeTimeout * NS_PER_SECOND;
+        else
+        {
+            int64_t heard = client.lastHeardNs.load(memory_order_relaxed);
+            if (config.idleTimeout > 0)
+                deadline = heard + config.idleTimeout * NS_PER_SECOND;
+            if (config.keepalive > 0)
+            {
+                int64_t check = heard + config.keepalive * NS_PER_SECOND;
+                if (check <= loop.now)
+                    check = loop.now + config.keepalive * NS_PER_SECOND; // found alive, look again a period later
+                deadline = min(deadline, check);
+            }
+        }
+        if (deadline == INT64_MAX)
+            loop.timers.cancel(client.timer);
+        else
+            loop.timers.schedule(client.timer, deadline);
+    }
+
+    // The session's timer fired. Reads never touch the wheel, they only stamp
+    // lastHeardNs, so a busy session just gets its timer pushed back here.
+    void checkDeadlines(IoLoop &loop, ClientInfo *raw)
+    {
+        auto it = loop.conns.find(raw->socket);
+        if (it == loop.conns.end() || it->second.get() != raw)
+            return;
+        shared_ptr<ClientInfo> client = it->second;
+        ClientInfo::State state = client->state;
+        if (state == ClientInfo::State::Closed)
+            return;
+        if (state == ClientInfo::State::Handshake && config.handshakeTimeout > 0)
+        {
+            if (loop.now - client->acceptedNs >= config.handshakeTimeout * NS_PER_SECOND)
+            {
+                timeOut(loop, client, client->addr, "no username sent");
+                return;
+            }
+        }
+        else
+        {
+            int64_t silent = loop.now - client->lastHeardNs.load(memory_order_relaxed);
+            const string &who = state == ClientInfo::State::Active ? client->name : client->addr;
+            if (config.idleTimeout > 0 && silent >= config.idleTimeout * NS_PER_SECOND)
+            {
+                timeOut(loop, client, who, "idle");
+                return;
+            }
+            if (config.keepalive > 0 && silent >= config.keepalive * NS_PER_SECOND && !peerResponding(*client))
+            {
+                timeOut(loop, client, who, "peer stopped responding");
+                return;
+            }
+        }
+        armDeadline(loop, *client);
+    }
+
+    // Data left unacknowledged through retransmissions for a whole keepalive
+    // period means the peer is gone. With nothing in flight the kernel's
+    // keepalive probes decide instead, and a failed probe wakes the reader.
+    bool peerResponding(ClientInfo &client)
+    {
+        tcp_info info{};
+        socklen_t len = sizeof(info);
+        lock_guard<mutex> lock(client.writeMutex);
+        if (client.closed || getsockopt(client.socket, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+            return true;
+        return info.tcpi_retransmits == 0 || info.tcpi_last_ack_recv < static_cast<uint32_t>(config.keepalive) * 1000;
+    }
+
+    // A reactor loop owns the socket and closes it. In thread mode the handler
+    // thread does, so the output loop only shuts it down; that also wakes a
+    // handler still blocked in recv waiting for a username.
+    void timeOut(IoLoop &loop, const shared_ptr<ClientInfo> &client, const string &who, const char *reason)
+    {
+        Metrics::add(Metrics::TimedOut);
+        cout << COLOR_YELLOW << "⌛ Closing " << who << ": " << reason << COLOR_RESET << endl;
+        if (!loop.writeOnly)
+        {
+            dropClient(loop, client);
+            return;
+        }
+        lock_guard<mutex> lock(client->writeMutex);
+        if (!client->closed)
+            shutdown(client->socket, SHUT_RDWR);
+    }
+
+    void enableKeepalive(int fd)
+    {
+        int on = 1, idle = config.keepalive, interval = max(1, config.keepalive / 4), probes = 4;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+    }
+
+    // Reactor mode keeps every member of a room on the loop that owns the
+    // room, so its fan-out never writes to another thread's sockets. Runs
+    // `then` wherever the session ends up: here, or on the owner once the
+    // session has been handed over.
+    void followRoom(const shared_ptr<ClientInfo> &client, function<void()> then)
+    {
+        size_t owner;
+        if (currentLoop && scheduler.ownerOf(client->room, owner) && ioLoops[owner].get() != currentLoop)
+            migrateClient(client, *ioLoops[owner], move(then));
+        else
+            then();
+    }
+
+    // Runs on the session's current loop, which stops reading it at once; the
+    // caller must not touch the session's inbox afterwards. Whatever is still
+    // buffered is picked up by the target after `then`.
+    void migrateClient(const shared_ptr<ClientInfo> &client, IoLoop &target, function<void()> then)
+    {
+        IoLoop &from = *client->loop;
+        {
+            lock_guard<mutex> lock(client->writeMutex);
+            if (!client->closed)
+                epoll_ctl(from.epollFd, EPOLL_CTL_DEL, client->socket, nullptr);
+        }
+        releaseClient(from, client);
+        client->loop = &target;
+        Metrics::add(Metrics::SessionMigrations);
+        postToLoop(target, [this, &target, client, then = move(then)] {
+            if (!adoptClient(target, client))
+            {
+                handleDisconnect(client);
+                return;
+            }
+            if (then)
+                then();
+            resumeClient(target, client);
+        });
+    }
+
+    // A migrated session carries on: frames the old loop had already read
+    // first, then the socket. If its room moved again meanwhile it hops on.
+    void resumeClient(IoLoop &loop, const shared_ptr<ClientInfo> &client)
+    {
+        if (client->state != ClientInfo::State::Active || client->loop != &loop)
+            return;
+        size_t owner;
+        if (scheduler.ownerOf(client->room, owner) && ioLoops[owner].get() != &loop)
+        {
+            migrateClient(client, *ioLoops[owner], nullptr);
+            return;
+        }
+        bool alive = client->protocol != ClientInfo::Protocol::Framed || processFrames(client);
+        if (alive && !movedAway(*client))
+            alive = serviceClient(client, EPOLLIN);
+        if (!alive)
+            dropClient(loop, client);
+    }
+
+    // True once the session has been handed to another loop than this thread's
+    static bool movedAway(const ClientInfo &client)
+    {
+        return client.loop != currentLoop;
+    }
+
+    // Runs `task` on the loop serving the session (right here in thread mode).
+    // A task that reaches a loop the session has just left follows it.
+    void runOnOwner(const shared_ptr<ClientInfo> &client, function<void()> task)
+    {
+        IoLoop *owner = client->loop;
+        if (!owner || owner == currentLoop)
+        {
+            task();
+            return;
+        }
+        postToLoop(*owner, [this, owner, client, task = move(task)]() mutable {
+            if (client->loop != owner)
+                runOnOwner(client, move(task));
+            else
+                task();
+        });
+    }
+
+    // Runs `task` on the loop that owns the room, or right here if nobody does
+    void runOnRoomOwner(const string &room, function<void()> task)
+    {
+        size_t owner;
+        if (!scheduler.ownerOf(room, owner) || ioLoops[owner].get() == currentLoop)
+        {
+            task();
+            return;
+        }
+        postToLoop(*ioLoops[owner], move(task));
+    }
+
+    // Every rebalanceMs, collects each loop's per-room traffic by message and
+    // lets the scheduler move one room off a loop that carries far more than
+    // its share. The old owner then hands the room's members over.
+    void rebalanceLoop()
+    {
+        const double SKEW = 1.5;           // busiest loop vs. the average before anything moves
+        const uint64_t MIN_TRAFFIC = 1000; // copies per window; below this skew is noise
+        struct Gather
+        {
+            mutex m;
+            condition_variable done;
+            size_t remaining = 0;
+            unordered_map<string, uint64_t> traffic;
+            uint64_t total = 0;
+        };
+        while (running)
+        {
+            this_thread::sleep_for(chrono::milliseconds(config.rebalanceMs));
+            auto gather = make_shared<Gather>();
+            gather->remaining = ioLoops.size();
+            for (auto &loop : ioLoops)
+            {
+                IoLoop *l = loop.get();
+                postToLoop(*l, [l, gather] {
+                    lock_guard<mutex> lock(gather->m);
+                    for (auto &entry : l->roomTraffic)
                     {
-                        lock_guard<mutex> lock(clientsMutex);
-                        for (auto &c : clients)
-                        {
-                            if (c.socket == clientSocket)
-                            {
-                                c.room = newRoom;
-                            }
-                        }
+                        gather->traffic[entry.first] += entry.second;
+                        gather->total += entry.second;
                     }
+                    l->roomTraffic.clear();
+                    if (--gather->remaining == 0)
+                        gather->done.notify_one();
+                });
+            }
+
+            RoomScheduler::Move move;
+            {
+                unique_lock<mutex> lock(gather->m);
+                if (!gather->done.wait_for(lock, chrono::seconds(1), [&gather] { return gather->remaining == 0; }))
+                    continue;
+                if (gather->total < MIN_TRAFFIC || !scheduler.rebalance(gather->traffic, SKEW, move))
+                    continue;
+            }
+            Metrics::add(Metrics::RoomMoves);
+            cout << COLOR_CYAN << "⇄ Room " << move.room << " moved from I/O thread " << move.from << " to "
+                 << move.to << " (" << move.traffic << " of " << gather->total << " copies)" << COLOR_RESET << endl;
+            IoLoop &from = *ioLoops[move.from];
+            IoLoop &to = *ioLoops[move.to];
+            postToLoop(from, [this, &to, room = move.room] { migrateRoom(room, to); });
+        }
+    }
+
+    // Runs on the room's old owner: hands every member it still serves to the new one
+    void migrateRoom(const string &room, IoLoop &to)
+    {
+        vector<shared_ptr<ClientInfo>> members;
+        for (auto &entry : currentLoop->conns)
+        {
+            if (entry.second->state == ClientInfo::State::Active && entry.second->room == room)
+                members.push_back(entry.second);
+        }
+        for (auto &c : members)
+            migrateClient(c, to, nullptr);
+    }
+
+    void runIoLoop(IoLoop *loop)
+    {
+        pinCurrentThread(loop->index);
+        if (!loop->writeOnly)
+            currentLoop = loop;
+        const int MAX_EVENTS = 256;
+        epoll_event events[MAX_EVENTS];
+
+        while (running)
+        {
+            // Sleeps until the next deadline at most; the clock is read once per wakeup
+            int n = epoll_wait(loop->epollFd, events, MAX_EVENTS, loop->timers.timeoutMs(TokenBucket::nowNs()));
+            loop->now = TokenBucket::nowNs();
+            OutputBatch batch(*this); // flushed once every event of this wakeup is handled
+            for (int i = 0; i < n; ++i)
+            {
+                if (events[i].data.ptr == loop)
+                {
+                    runPostedTasks(*loop);
+                    continue;
+                }
+                auto listener = find(loop->listeners.begin(), loop->listeners.end(), events[i].data.ptr);
+                if (listener != loop->listeners.end())
+                {
+                    if (!acceptBatch(**listener, loop) && !loop->acceptResume.armed())
+                    {
+                        watchListeners(*loop, 0);
+                        loop->timers.schedule(loop->acceptResume, loop->now + ACCEPT_BACKOFF_MS * 1000000LL);
+                    }
+                    continue;
+                }
+
+                auto *raw = static_cast<ClientInfo *>(events[i].data.ptr);
+                if (loop->writeOnly)
+                {
+                    // The handler thread owns the socket and notices the EOF
+                    if (!flushOutbox(*raw))
+                        shutdown(raw->socket, SHUT_RDWR);
+                    continue;
+                }
+                // A client that migrated or closed earlier in this batch is no longer in conns
+                auto it = loop->conns.find(raw->socket);
+                if (it == loop->conns.end() || it->second.get() != raw)
+                    continue;
+                shared_ptr<ClientInfo> client = it->second;
+                if (client->state == ClientInfo::State::Closed)
+                    continue;
+
+                if (!serviceClient(client, events[i].events))
+                    dropClient(*loop, client);
+            }
+            loop->timers.advance(loop->now);
+            // Disconnected clients stay alive until the batch is done, later events may still point at them
+            loop->closing.clear();
+        }
+    }
+
+    // Advances one connection's state machine; false means the peer is gone.
+    // Edge-triggered, so the socket is drained until EAGAIN; each read is one
+    // packet, exactly as recv() delimits messages in thread mode.
+    bool serviceClient(const shared_ptr<ClientInfo> &client, uint32_t events)
+    {
+        if ((events & EPOLLOUT) && !flushOutbox(*client))
+            return false;
+        if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+            return true;
+
+        if (client->protocol == ClientInfo::Protocol::Unknown && !detectProtocol(*client))
+            return false;
+        if (client->protocol == ClientInfo::Protocol::Unknown)
+            return true; // spurious wakeup, nothing to peek at yet
+        if (client->protocol == ClientInfo::Protocol::Framed)
+        {
+            while (true)
+            {
+                ssize_t bytes = readIntoInbox(*client);
+                if (bytes < 0)
+                {
+                    client->inbox.releaseIfEmpty();
+                    return true;
+                }
+                if (bytes == 0 || !processFrames(client))
+                    return false;
+                if (movedAway(*client))
+                    return true; // the new loop reads the rest
+            }
+        }
+
+        char buffer[1024];
+        while (true)
+        {
+            bool handshake = client->state == ClientInfo::State::Handshake;
+            size_t want = handshake ? 63 : sizeof(buffer) - 1;
+            ssize_t bytes = recv(client->socket, buffer, want, 0);
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if (bytes <= 0)
+                return false;
+            Metrics::add(Metrics::BytesIn, bytes);
+            heardFrom(*client);
+
+            if (handshake)
+            {
+                if (!completeHandshake(client, string(buffer, bytes)))
+                    return false;
+            }
+            else
+            {
+                Encryption::applyInPlace(buffer, bytes);
+                handleMessage(client, string(buffer, buffer + bytes));
+            }
+            if (movedAway(*client))
+                return true;
+        }
+    }
+
+    // The first byte tells a framed client (preamble) from a legacy one (bare
+    // username). False on EOF or error; a drained socket leaves it Unknown.
+    bool detectProtocol(ClientInfo &client)
+    {
+        unsigned char first;
+        ssize_t r;
+        do
+            r = recv(client.socket, &first, 1, MSG_PEEK);
+        while (r < 0 && errno == EINTR);
+        if (r < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        if (r == 0)
+            return false;
+        client.protocol = first == Framing::MAGIC[0] ? ClientInfo::Protocol::Framed : ClientInfo::Protocol::Text;
+        return true;
+    }
+
+    // The loop's clock as of its wakeup; handler threads read the clock themselves
+    static int64_t clockNs()
+    {
+        return currentLoop ? currentLoop->now : TokenBucket::nowNs();
+    }
+
+    // Input resets the idle and keepalive deadlines without touching the timer
+    static void heardFrom(ClientInfo &client)
+    {
+        client.lastHeardNs.store(clockNs(), memory_order_relaxed);
+    }
+
+    // Reads what the socket has straight into the client's ring buffer.
+    // Returns the byte count, 0 on EOF or error, -1 once a non-blocking socket is drained.
+    static ssize_t readIntoInbox(ClientInfo &client)
+    {
+        iovec iov[2];
+        int segments = client.inbox.writableSegments(iov);
+        while (true)
+        {
+            ssize_t bytes = readv(client.socket, iov, segments);
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return -1;
+            if (bytes <= 0)
+                return 0;
+            Metrics::add(Metrics::BytesIn, bytes);
+            heardFrom(client);
+            client.inbox.commit(bytes);
+            return bytes;
+        }
+    }
+
+    // Handles every complete frame in the inbox, parsed where it lies.
+    // False on a protocol violation, which closes the connection.
+    bool processFrames(const shared_ptr<ClientInfo> &client)
+    {
+        Framing::RingBuffer &inbox = client->inbox;
+        if (!client->preambleSeen)
+        {
+            Framing::ParseStatus status = Framing::readPreamble(inbox);
+            if (status != Framing::ParseStatus::Complete)
+                return status == Framing::ParseStatus::Incomplete;
+            client->preambleSeen = true;
+        }
+
+        string scratch; // only touched by a frame that wraps around the ring
+        Framing::Frame frame;
+        while (true)
+        {
+            Framing::ParseStatus status = Framing::nextFrame(inbox, scratch, frame);
+            if (status == Framing::ParseStatus::Incomplete)
+                return true;
+            if (status == Framing::ParseStatus::Invalid)
+                return false;
+
+            bool handshake = client->state == ClientInfo::State::Handshake;
+            if (handshake != (frame.type == Framing::FrameType::Hello))
+                return false; // Hello must come first and only once
+            if (frame.type != Framing::FrameType::Hello && frame.type != Framing::FrameType::Text)
+                return false;
+
+            Encryption::applyInPlace(frame.payload, frame.length);
+            string text(frame.payload, frame.length);
+            inbox.consume(frame.size);
+            if (handshake)
+            {
+                if (!completeHandshake(client, text))
+                    return false;
+            }
+            else
+                handleMessage(client, move(text));
+            if (movedAway(*client))
+                return true; // the rest of the inbox belongs to the new loop
+        }
+    }
+
+    // Registers the client under the name it sent as its first packet.
+    // False if the name is taken; the caller then closes the connection.
+    bool completeHandshake(const shared_ptr<ClientInfo> &client, const string &raw)
+    {
+        string username = raw.substr(0, raw.find('\0'));
+        while (!username.empty() && (username.back() == '\n' || username.back() == '\r'))
+            username.pop_back();
+        if (username.empty())
+            username = "Anonymous";
+        
+        // Truncate username if too long (safety check)
+        if (username.length() > MAX_NAME)
+            username = username.substr(0, MAX_NAME);
+
+        client->name = username;
+        if (!registry.add(client))
+        {
+            string taken = "[SERVER] Username '" + username + "' is already taken. Reconnect with another name.\n";
+            sendAll(*client, taken.c_str(), taken.size());
+            cout << COLOR_YELLOW << "⚠ Rejected duplicate username: " << COLOR_RESET << username << endl;
+            return false;
+        }
+        client->userId = userIds.acquire(username); // released in handleDisconnect
+        client->state = ClientInfo::State::Active;
+        registry.join(client, "general");
+        scheduler.join("general");
+
+        followRoom(client, [this, client] {
+            string joinMsg = "[" + nowTimestamp() + "] " + client->name + " joined the chat (room: general)";
+            announcePresence("general", client, PresenceBatcher::Change::Joined, joinMsg);
+            sendRoomHistory(client, "general");
+        });
+        return true;
+    }
+
+    void handleDisconnect(const shared_ptr<ClientInfo> &client)
+    {
+        bool wasActive = client->state == ClientInfo::State::Active;
+        client->state = ClientInfo::State::Closed;
+        removeClient(client);
+        closeClient(*client);
+        if (!wasActive)
+            return;
+        releaseNames(*client);
+        scheduler.leave(client->room);
+        string leftMsg = "[" + nowTimestamp() + "] " + client->name + " left the chat";
+        announcePresence(client->room, client, PresenceBatcher::Change::Left, leftMsg);
+    }
+
+    // A join or leave in `room`. With a presence window it only counts toward
+    // the room's next summary; otherwise `line` goes out at once to everyone
+    // but the client it is about.
+    void announcePresence(const string &room, const shared_ptr<ClientInfo> &client, PresenceBatcher::Change change,
+                          const string &line)
+    {
+        Metrics::add(Metrics::PresenceEvents);
+        if (config.presenceWindowMs > 0)
+        {
+            if (presence.add(room, client->name, change, clockNs()))
+            {
+                IoLoop &loop = housekeepingLoop();
+                postToLoop(loop, [this, &loop] { armPresenceFlush(loop); });
+            }
+            return;
+        }
+        bool joined = change == PresenceBatcher::Change::Joined;
+        cout << (joined ? COLOR_GREEN "→ " : COLOR_RED "← ") << COLOR_RESET << line << endl;
+        runOnRoomOwner(room, [this, room, line, client] { sendPresence(room, line, client.get()); });
+    }
+
+    // Runs on the room's owner
+    void sendPresence(const string &room, const string &line, const ClientInfo *about)
+    {
+        Metrics::add(Metrics::PresenceLines);
+        broadcastMessage(line, about, room);
+        if (config.presenceHistory)
+            saveMessage(room, line);
+    }
+
+    // Housekeeping loop: the timer follows the oldest pending batch
+    void armPresenceFlush(IoLoop &loop)
+    {
+        int64_t deadline;
+        if (presence.nextDue(deadline))
+            loop.timers.schedule(presenceFlush, deadline);
+    }
+
+    void flushPresence(IoLoop &loop)
+    {
+        vector<PresenceBatcher::Summary> summaries;
+        presence.takeDue(loop.now, summaries);
+        armPresenceFlush(loop);
+        for (auto &summary : summaries)
+        {
+            string line = "[" + nowTimestamp() + "] " + describePresence(summary);
+            cout << COLOR_CYAN << "⇆ " << COLOR_RESET << "#" << summary.room << " " << line << endl;
+            runOnRoomOwner(summary.room, [this, room = summary.room, line] { sendPresence(room, line, nullptr); });
+        }
+    }
+
+    // "alice and bob joined; carol left", naming a few and counting the rest
+    static string describePresence(const PresenceBatcher::Summary &summary)
+    {
+        auto names = [](const vector<string> &list) {
+            const size_t SHOWN = 5;
+            size_t shown = list.size() <= SHOWN ? list.size() : SHOWN - 1;
+            string out;
+            for (size_t i = 0; i < shown; ++i)
+            {
+                if (i > 0)
+                    out += i + 1 == list.size() ? " and " : ", ";
+                out += list[i];
+            }
+            if (shown < list.size())
+                out += " and " + to_string(list.size() - shown) + " others";
+            return out;
+        };
+        string text;
+        if (!summary.joined.empty())
+            text = names(summary.joined) + " joined";
+        if (!summary.left.empty())
+            text += (text.empty() ? "" : "; ") + names(summary.left) + " left";
+        return text;
+    }
+
+    // Drops the references an active session held on its own name and on
+    // every name it blocked
+    void releaseNames(const ClientInfo &client)
+    {
+        userIds.release(client.userId);
+        Epoch::Guard guard;
+        if (const IdSet *blocked = client.blockedUsers.load())
+            blocked->forEach([this](uint32_t id) { userIds.release(id); });
+    }
+
+    // Runs one decrypted message (a legacy packet or a Text frame) through
+    // command handling; shared by both server modes and both protocols
+    void handleMessage(const shared_ptr<ClientInfo> &client, string msg)
+    {
+        Trace::Sample sample("message");
+        while (!msg.empty() && (msg.back() == '\n' || msg.back() == '\r'))
+            msg.pop_back();
+        if (msg.empty())
+            return;
+
+        // Chat lines never look further than their first byte
+        if (msg[0] == '/')
+        {
+            string_view line(msg);
+            size_t space = line.find(' ');
+            string_view name = line.substr(0, space);
+            string_view args = space == string_view::npos ? string_view() : line.substr(space + 1);
+            if (const ChatCommand *command = findCommand(name))
+            {
+                if (command->run)
+                    (this->*command->run)(client, args);
+                return;
+            }
+            // Unknown commands are chatted as typed, as they always were
+        }
+        chatMessage(client, msg);
+    }
+
+    using CommandHandler = void (ChatServer::*)(const shared_ptr<ClientInfo> &, string_view);
+
+    struct ChatCommand
+    {
+        string_view name;  // including the slash
+        string_view usage; // left column of /help
+        string_view help;
+        CommandHandler run; // null: handled by the client, ignored here
+    };
+
+    static constexpr size_t COMMAND_COUNT = 12;
+    using CommandTable = array<ChatCommand, COMMAND_COUNT>;
+
+    // Every slash command, in /help order; dispatch and /help both come from here
+    static constexpr CommandTable makeCommandTable()
+    {
+        return {{
+            {"/list", "/list", "List online users", &ChatServer::listCommand},
+            {"/rooms", "/rooms", "List all active rooms", &ChatServer::roomsCommand},
+            {"/join", "/join <room>", "Join or create a room", &ChatServer::joinCommand},
+            {"/pm", "/pm <user> <msg>", "Private message", &ChatServer::pmCommand},
+            {"/block", "/block <user>", "Block messages from a user", &ChatServer::blockCommand},
+            {"/unblock", "/unblock <user>", "Unblock a user", &ChatServer::unblockCommand},
+            {"/blocklist", "/blocklist", "Show your blocked users", &ChatServer::blocklistCommand},
+            {"/pin", "/pin <msg>", "Pin a message to the room board", &ChatServer::pinCommand},
+            {"/pins", "/pins", "Show pinned messages for the room", &ChatServer::pinsCommand},
+            {"/unpin", "/unpin <id>", "Remove a pinned message by its #id", &ChatServer::unpinCommand},
+            {"/quit", "/quit", "Disconnect from server", nullptr},
+            {"/help", "/help", "Show this help", &ChatServer::helpCommand},
+        }};
+    }
+
+    static const CommandTable &commandTable()
+    {
+        static constexpr CommandTable COMMANDS = makeCommandTable();
+        return COMMANDS;
+    }
+
+    // Compile-time perfect hash over the command names: FNV-1a with a seed
+    // searched until every name lands in its own bucket
+    static constexpr size_t COMMAND_BUCKETS = 32;
+
+    struct CommandIndex
+    {
+        uint32_t seed = 0;
+        array<int8_t, COMMAND_BUCKETS> slot{};
+    };
+
+    static constexpr uint32_t commandHash(string_view name, uint32_t seed)
+    {
+        uint32_t h = 2166136261u ^ seed;
+        for (char c : name)
+        {
+            h ^= static_cast<unsigned char>(c);
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    static constexpr CommandIndex buildCommandIndex(const CommandTable &table)
+    {
+        for (uint32_t seed = 0;; ++seed)
+        {
+            CommandIndex index;
+            index.seed = seed;
+            for (auto &s : index.slot)
+                s = -1;
+            bool perfect = true;
+            for (size_t i = 0; i < table.size() && perfect; ++i)
+            {
+                auto &s = index.slot[commandHash(table[i].name, seed) % COMMAND_BUCKETS];
+                perfect = s < 0;
+                s = static_cast<int8_t>(i);
+            }
+            if (perfect)
+                return index;
+        }
+    }
+
+    static const ChatCommand *findCommand(string_view name)
+    {
+        static constexpr CommandIndex INDEX = buildCommandIndex(makeCommandTable());
+        int8_t i = INDEX.slot[commandHash(name, INDEX.seed) % COMMAND_BUCKETS];
+        if (i < 0 || commandTable()[i].name != name)
+            return nullptr;
+        return &commandTable()[i];
+    }
+
+    void helpCommand(const shared_ptr<ClientInfo> &client, string_view)
+    {
+        string help = "Available Commands:\n";
+        for (const ChatCommand &command : commandTable())
+        {
+            help.append(command.usage);
+            help.append(command.usage.size() < 20 ? 20 - command.usage.size() : 1, ' ');
+            help += "- ";
+            help.append(command.help);
+            help += "\n";
+        }
+        help += "\n"; // <- IMPORTANT: ensures it prints immediately
+        sendAll(*client, help.c_str(), help.size());
+    }
+
+    void roomsCommand(const shared_ptr<ClientInfo> &client, string_view)
+    {
+        string out = "Active Rooms:\n";
+        registry.forEachRoom([&out](const string &name, size_t members) {
+            out += " - " + name + " (" + to_string(members) + " users)\n";
+        });
+        sendAll(*client, out.c_str(), out.size());
+    }
+
+    void listCommand(const shared_ptr<ClientInfo> &client, string_view)
+    {
+        if (ioLoops.empty())
+        {
+            string listMsg = "Online users:\n";
+            registry.forEachSession([&listMsg](const shared_ptr<ClientInfo> &c) {
+                listMsg += " - " + c->name + " (room: " + c->room + ")\n";
+            });
+            sendAll(*client, listMsg.c_str(), listMsg.size());
+            return;
+        }
+
+        // Reactor mode asks every loop for the sessions it serves instead of
+        // freezing the registry; the last loop to answer sends the list
+        struct Gather
+        {
+            mutex m;
+            size_t remaining = 0;
+            vector<pair<string, string>> users; // name, room
+        };
+        auto gather = make_shared<Gather>();
+        gather->remaining = ioLoops.size();
+        for (auto &loop : ioLoops)
+        {
+            IoLoop *l = loop.get();
+            postToLoop(*l, [this, l, gather, client] {
+                vector<pair<string, string>> mine;
+                for (auto &entry : l->conns)
+                {
+                    if (entry.second->state == ClientInfo::State::Active)
+                        mine.emplace_back(entry.second->name, entry.second->room);
+                }
+                vector<pair<string, string>> users;
+                {
+                    lock_guard<mutex> lock(gather->m);
+                    gather->users.insert(gather->users.end(), mine.begin(), mine.end());
+                    if (--gather->remaining > 0)
+                        return;
+                    users.swap(gather->users);
+                }
+                sort(users.begin(), users.end());
+                string listMsg = "Online users:\n";
+                for (auto &u : users)
+                    listMsg += " - " + u.first + " (room: " + u.second + ")\n";
+                runOnOwner(client, [this, client, listMsg] { sendAll(*client, listMsg.c_str(), listMsg.size()); });
+            });
+        }
+    }
+
+    void joinCommand(const shared_ptr<ClientInfo> &client, string_view args)
+    {
+        const string &username = client->name;
+        string newRoom = args.empty() ? "general" : string(args);
+        if (!RoomNames::valid(newRoom))
+        {
+            string err = "Invalid room name: at most " + to_string(RoomNames::MAX_LENGTH) +
+                         " bytes, no '/', '..' or control characters.\n";
+            sendAll(*client, err.c_str(), err.size());
+            return;
+        }
+        string oldRoom = client->room; // this thread is the only one that moves it
+        if (oldRoom == newRoom)
+            return;
+
+        string leftMsg = "[" + nowTimestamp() + "] " + username + " left room " + oldRoom;
+        announcePresence(oldRoom, client, PresenceBatcher::Change::Left, leftMsg);
+
+        pins.preload(newRoom);
+        registry.join(client, newRoom);
+        scheduler.leave(oldRoom);
+        scheduler.join(newRoom);
+
+        // The rest happens on the new room's loop
+        followRoom(client, [this, client, newRoom] {
+            string joinMsg = "[" + nowTimestamp() + "] " + client->name + " joined room " + newRoom;
+            announcePresence(newRoom, client, PresenceBatcher::Change::Joined, joinMsg);
+            sendRoomHistory(client, newRoom);
+        });
+    }
+
+    void blockCommand(const shared_ptr<ClientInfo> &client, string_view args)
+    {
+        if (args.empty())
+        {
+            string err = "Usage: /block <username>\n";
+            sendAll(*client, err.c_str(), err.size());
+            return;
+        }
+        string targetUser(args);
+        uint32_t target = 0;
+        if (userIds.find(targetUser, target) && isBlocking(*client, target))
+        {
+            string msg = "User '" + targetUser + "' is already blocked.\n";
+            sendAll(*client, msg.c_str(), msg.size());
+        }
+        else if (targetUser.size() > MAX_NAME)
+        {
+            string err = "No user can have a name that long.\n";
+            sendAll(*client, err.c_str(), err.size());
+        }
+        else if (blockedCount(*client) >= MAX_BLOCKED)
+        {
+            string err = "You can block at most " + to_string(MAX_BLOCKED) + " users.\n";
+            sendAll(*client, err.c_str(), err.size());
+        }
+        else
+        {
+            // The entry holds a reference until /unblock or disconnect
+            target = userIds.acquire(targetUser);
+            client->blockedUsers.update([target](IdSet &blocked) { blocked.insert(target); });
+            string msg = "Blocked user '" + targetUser + "'.\n";
+            sendAll(*client, msg.c_str(), msg.size());
+        }
+    }
+
+    void unblockCommand(const shared_ptr<ClientInfo> &client, string_view args)
+    {
+        if (args.empty())
+        {
+            string err = "Usage: /unblock <username>\n";
+            sendAll(*client, err.c_str(), err.size());
+            return;
+        }
+        string targetUser(args);
+        uint32_t target = 0;
+        if (userIds.find(targetUser, target) && isBlocking(*client, target))
+        {
+            client->blockedUsers.update([target](IdSet &blocked) { blocked.erase(target); });
+            userIds.release(target);
+            string msg = "Unblocked user '" + targetUser + "'.\n";
+            sendAll(*client, msg.c_str(), msg.size());
+        }
+        else
+        {
+            string msg = "User '" + targetUser + "' is not blocked.\n";
+            sendAll(*client, msg.c_str(), msg.size());
+        }
+    }
 
-                    string joinMsg = "[" + nowTimestamp() + "] " + username + " joined room " + newRoom;
-                    broadcastMessage(joinMsg, clientSocket, newRoom);
-                    saveMessage(newRoom, joinMsg);
+    void blocklistCommand(const shared_ptr<ClientInfo> &client, string_view)
+    {
+        vector<string> names;
+        {
+            Epoch::Guard guard;
+            const IdSet *blocked = client->blockedUsers.load();
+            if (blocked)
+                blocked->forEach([&](uint32_t id) { names.push_back(userIds.name(id)); });
+        }
+        if (names.empty())
+        {
+            string msg = "You have no blocked users.\n";
+            sendAll(*client, msg.c_str(), msg.size());
+            return;
+        }
+        sort(names.begin(), names.end());
+        string msg = "Blocked users:\n";
+        for (const auto &u : names)
+            msg += " - " + u + "\n";
+        sendAll(*client, msg.c_str(), msg.size());
+    }
 
-                    sendRoomHistory(clientSocket, newRoom);
-                }
+    void pinCommand(const shared_ptr<ClientInfo> &client, string_view args)
+    {
+        if (args.empty())
+        {
+            string err = "Usage: /pin <message>\n";
+            sendAll(*client, err.c_str(), err.size());
+            return;
+        }
+        const string &room = client->room;
+        string formatted = "📌 [" + nowTimestamp() + "] " + client->name + ": ";
+        formatted.append(args);
+        uint64_t id = pins.pin(room, formatted);
+        string notice = "[" + nowTimestamp() + "] " + client->name + " pinned a message.";
+        broadcastMessage(notice, nullptr, room);
+        string ok = "Pinned as #" + to_string(id) + ".\n";
+        sendAll(*client, ok.c_str(), ok.size());
+    }
 
-                continue;
+    void pinsCommand(const shared_ptr<ClientInfo> &client, string_view)
+    {
+        const string &room = client->room;
+        string out = "Pinned messages in '" + room + "':\n";
+        size_t count = pins.forEach(room, [&out](uint64_t id, const string &text) {
+            out += "#" + to_string(id) + " " + text + "\n";
+        });
+        if (count == 0)
+            out = "No pins yet.\n";
+        sendAll(*client, out.c_str(), out.size());
+    }
+
+    void unpinCommand(const shared_ptr<ClientInfo> &client, string_view args)
+    {
+        if (!args.empty() && args[0] == '#')
+            args.remove_prefix(1);
+        uint64_t id = 0;
+        auto parsed = from_chars(args.data(), args.data() + args.size(), id);
+        if (parsed.ec != errc() || parsed.ptr != args.data() + args.size() || id == 0)
+        {
+            string err = "Usage: /unpin <id>\n";
+            sendAll(*client, err.c_str(), err.size());
+            return;
+        }
+        if (!pins.unpin(client->room, id))
+        {
+            string err = "No pin #" + to_string(id) + " in this room.\n";
+            sendAll(*client, err.c_str(), err.size());
+            return;
+        }
+        string ok = "Unpinned #" + to_string(id) + ".\n";
+        sendAll(*client, ok.c_str(), ok.size());
+    }
+
+    void pmCommand(const shared_ptr<ClientInfo> &client, string_view args)
+    {
+        size_t space = args.find(' ');
+        if (space == string_view::npos)
+        {
+            string err = "Usage: /pm <username> <message>\n";
+            sendAll(*client, err.c_str(), err.size());
+            return;
+        }
+        sendPrivateMessage(client, string(args.substr(0, space)), args.substr(space + 1));
+    }
+
+    void chatMessage(const shared_ptr<ClientInfo> &client, const string &msg)
+    {
+        const string &username = client->name;
+        const string &room = client->room; // this thread is the only one that moves it
+
+        // Rate limit and room slowmode: one snapshot read, two atomic buckets, no locks
+        RateLimit rate;
+        int slowSeconds = 0;
+        {
+            Trace::Span span("rate_check");
+            roomLimits(room, rate, slowSeconds);
+        }
+        int64_t now = clockNs(); // buckets refill lazily against it, no timer per client
+        RateLimit slowmode = slowSeconds > 0 ? RateLimit{1.0 / slowSeconds, 1} : RateLimit{};
+
+        // Both buckets are checked before either is taken from, so a message
+        // one of them turns away costs nothing in the other. Only this thread
+        // takes from them, so the check still holds when it takes.
+        if (client->rateBucket.waitNs(rate, now) > 0)
+        {
+            Metrics::add(Metrics::RateLimited);
+            string warn = "⚠️ Rate limit exceeded. Slow down!\n";
+            sendAll(*client, warn.c_str(), warn.size());
+            return;
+        }
+        if (int64_t wait = client->slowmodeBucket.waitNs(slowmode, now))
+        {
+            Metrics::add(Metrics::SlowmodeRejected);
+            int64_t remaining = (wait + 999999999) / 1000000000;
+            string warn = "⌛ Slowmode is on (" + to_string(slowSeconds) + "s). Wait " + to_string(remaining) + "s.\n";
+            sendAll(*client, warn.c_str(), warn.size());
+            return;
+        }
+        client->rateBucket.tryTake(rate, now);
+        client->slowmodeBucket.tryTake(slowmode, now);
+
+        string formatted = "[" + nowTimestamp() + "] " + username + ": " + msg;
+        cout << COLOR_BLUE << "💬 " << COLOR_RESET << formatted << endl;
+        Metrics::roomMessages(room, 1, 0);
+        broadcastMessage(formatted, client.get(), room);
+        saveMessage(room, formatted);
+    }
+
+    // The rate and slowmode a message in `room` is held to, from the current rules snapshot
+    void roomLimits(const string &room, RateLimit &rate, int &slowSeconds) const
+    {
+        Epoch::Guard guard;
+        const ChatRules *r = rules.load();
+        rate = r->rate;
+        slowSeconds = 0;
+        auto it = r->rooms.find(room);
+        if (it != r->rooms.end())
+        {
+            slowSeconds = it->second.slowmodeSeconds;
+            if (it->second.ownRate)
+                rate = it->second.rate;
+        }
+    }
+
+    static size_t blockedCount(const ClientInfo &client)
+    {
+        Epoch::Guard guard;
+        const IdSet *blocked = client.blockedUsers.load();
+        return blocked ? blocked->size() : 0;
+    }
+
+    // Reads the blocker's list lock-free; it only changes on the blocker's own thread
+    static bool isBlocking(const ClientInfo &blocker, uint32_t userId)
+    {
+        Epoch::Guard guard;
+        const IdSet *blocked = blocker.blockedUsers.load();
+        return blocked && blocked->contains(userId);
+    }
+
+    void sendPrivateMessage(const shared_ptr<ClientInfo> &from, const string &toUser, string_view msg)
+    {
+        shared_ptr<ClientInfo> target = registry.findByName(toUser);
+        if (!target)
+        {
+            string notice = "User '" + toUser + "' is not online.\n";
+            sendAll(*from, notice.c_str(), notice.size());
+            return;
+        }
+        // Check if receiver has blocked sender
+        if (isBlocking(*target, from->userId))
+        {
+            string notice = "Cannot send message: user has blocked you.\n";
+            sendAll(*from, notice.c_str(), notice.size());
+            return;
+        }
+        string formatted = "[PM from " + from->name + "] ";
+        formatted.append(msg);
+        formatted += "\n";
+        runOnOwner(target, [this, target, formatted] { sendAll(*target, formatted.c_str(), formatted.size()); });
+    }
+
+    // The pool is started by the first room that reaches parallelFanout, so a
+    // server without such rooms never runs its threads
+    FanoutPool &fanoutWorkers()
+    {
+        call_once(fanoutStarted, [this] {
+            // The broadcasting thread takes a share as well
+            size_t threads = config.fanoutThreads > 0 ? config.fanoutThreads : max(1u, thread::hardware_concurrency());
+            fanoutPool = make_unique<FanoutPool>(threads);
+        });
+        return *fanoutPool;
+    }
+
+    // Lock-free fan-out over the room's current member list; sender is null for server notices.
+    // Rooms of at least parallelFanout members are split across the fan-out
+    // pool, so the last recipient of a huge room no longer waits for all the others.
+    // Pool threads write to connections other threads own (a reactor loop's,
+    // a handler's) under each one's writeMutex, like any cross-thread send, and
+    // their shares bypass the tick's OutputBatch: each copy is written at once.
+    void broadcastMessage(const string &message, const ClientInfo *sender, const string &room)
+    {
+        Metrics::Timer timer(Metrics::BroadcastFanout);
+        Trace::Span span("broadcast");
+        Epoch::Guard guard; // one read section for the whole fan-out; it also covers the pool, which we wait for
+        auto members = registry.members(room);
+        bool parallel = config.parallelFanout > 0 && members.size() >= config.parallelFanout;
+        Payload line, frame; // encoded on first use per protocol, then shared
+        if (parallel)
+        {
+            // Pool threads share them, so no lazy encoding
+            Trace::Span encode("encrypt", static_cast<int64_t>(message.size()));
+            line = encodePayload(message, true);
+            frame = encodeFrame(message, true);
+        }
+        bool fromUser = sender != nullptr;
+        uint32_t senderId = fromUser ? sender->userId : 0;
+        auto deliver = [&](ClientInfo *c) {
+            if (c == sender)
+                return false;
+            // Check if receiver has blocked the sender
+            const IdSet *blocked = fromUser ? c->blockedUsers.load() : nullptr;
+            if (blocked && blocked->contains(senderId))
+                return false;
+            bool framed = c->protocol == ClientInfo::Protocol::Framed;
+            Payload &bytes = framed ? frame : line;
+            if (!bytes)
+            {
+                Trace::Span encode("encrypt", static_cast<int64_t>(message.size()));
+                bytes = framed ? encodeFrame(message, true) : encodePayload(message, true);
+            }
+            if (sendPayload(*c, bytes))
+                return true;
+            shutdown(c->socket, SHUT_RDWR); // owner sees EOF and cleans up
+            return false;
+        };
+
+        uint64_t queued = 0;
+        if (!parallel)
+        {
+            for (size_t i = 0; i < members.size(); ++i)
+                queued += deliver(members[i]);
+        }
+        else
+        {
+            atomic<uint64_t> total{0};
+            auto sendRange = [&](size_t lo, size_t hi) {
+                uint64_t n = 0;
+                for (size_t i = lo; i < hi; ++i)
+                    n += deliver(members[i]);
+                total.fetch_add(n, memory_order_relaxed);
+            };
+            // Every share is written as it is sent; this thread's batch would
+            // serialise the flush of its share again
+            OutputBatch *batch = OutputBatch::current;
+            OutputBatch::current = nullptr;
+            fanoutWorkers().parallelFor(members.size(), FANOUT_GRAIN, sendRange);
+            OutputBatch::current = batch;
+            queued = total.load();
+        }
+        Metrics::roomMessages(room, 0, queued);
+        span.setValue(static_cast<int64_t>(queued));
+        if (currentLoop)
+            currentLoop->roomTraffic[room] += queued + 1; // what the rebalancer weighs rooms by
+    }
+
+    // Owner thread only. The session may already be unregistered by a kick,
+    // but its room membership is always cleaned up here.
+    void removeClient(const shared_ptr<ClientInfo> &client)
+    {
+        registry.erase(client);
+        registry.leave(client);
+    }
+
+    // Unregisters at once so /list and /pm stop seeing the user; the owner
+    // leaves the room and closes the socket once it sees EOF
+    void kickUser(const string &username)
+    {
+        shared_ptr<ClientInfo> target = registry.findByName(username);
+        if (!target)
+        {
+            cout << COLOR_YELLOW << "⚠ No such user: " << COLOR_RESET << username << endl;
+            return;
+        }
+        runOnOwner(target, [this, target, username] {
+            if (!registry.erase(target))
+            {
+                cout << COLOR_YELLOW << "⚠ No such user: " << COLOR_RESET << username << endl;
+                return;
             }
+            string msg = "[SERVER] You have been kicked by admin.\n";
+            sendAll(*target, msg.c_str(), msg.size());
+            flushOutbox(*target); // the notice must leave before the shutdown, not with the batch
+            shutdown(target->socket, SHUT_RDWR); // owner closes once it sees EOF
+            cout << COLOR_RED << "⚠ Kicked user: " << COLOR_RESET << username << endl;
+        });
+    }
+};
 
-            if (msg.rfind("/block ", 0) == 0)
+// The benchmarks include this file for ChatServer and bring their own main
+#ifndef OPTICOM_NO_MAIN
+ChatServer *serverInstance = nullptr;
+void signalHandler(int signal)
+{
+    if (signal == SIGINT || signal == SIGTERM)
+    {
+        cout << "\n" << COLOR_RED << "⏻ Shutting down server..." << COLOR_RESET << endl;
+        if (serverInstance)
+            serverInstance->stop();
+        exit(0);
+    }
+}
+
+static void printUsage()
+{
+    cout << "Usage: ./opticom [port] [options]\n"
+         << "  --mode=threads|epoll   Thread per client (default) or epoll reactor\n"
+         << "  --io-threads=N         Reactor I/O threads in epoll mode (default 4)\n"
+         << "  --listeners=N          Bind N SO_REUSEPORT listeners, each with its own accept loop\n"
+         << "  --backlog=N            listen() backlog per listener (default SOMAXCONN)\n"
+         << "  --accept-batch=N       Max accept4 calls per wakeup (default 64)\n"
+         << "  --cpus=0,2,4           Pin I/O and accept threads to these cores\n"
+         << "  --queue-high=BYTES     Outbound queue size that marks a client slow (default 262144)\n"
+         << "  --queue-low=BYTES      Queue size a slow client must drain to (default 65536)\n"
+         << "  --slow-policy=P        drop-oldest (default), drop-new or disconnect\n"
+         << "  --history-sync=S       none (default), <N>ms or <N>msgs: when history is fsynced\n"
+         << "  --history-replay=N     Messages replayed when joining a room (default 100)\n"
+         << "  --segment-size=BYTES   History segment size before rotation (default 1048576)\n"
+         << "  --segments=N           History segments kept per room (default 16)\n"
+         << "  --cache-room=BYTES     Recent-message cache per room (default 65536)\n"
+         << "  --cache-total=BYTES    Recent-message cache for all rooms, 0 disables (default 67108864)\n"
+         << "  --rate=N               Messages per second per user, 0 disables (default 3)\n"
+         << "  --burst=N              Messages a user may send back to back (default 3)\n"
+         << "  --metrics-port=N       Serve Prometheus metrics on 127.0.0.1:N/metrics (default off)\n"
+         << "  --rebalance-ms=N       Epoll mode: check room placement every N ms, 0 disables (default 1000)\n"
+         << "  --parallel-fanout=N    Rooms with N+ members fan out on a work-stealing pool, 0 disables (default 4096)\n"
+         << "  --fanout-threads=N     Fan-out pool threads (default: one per core)\n"
+         << "  --handshake-timeout=S  Seconds a new connection has to send its username, 0 disables (default 10)\n"
+         << "  --idle-timeout=S       Close sessions silent for S seconds, 0 disables (default 0)\n"
+         << "  --keepalive=S          Check peers silent for S seconds for life, 0 disables (default 60)\n"
+         << "  --presence-window=MS   Sum up joins and leaves per room over MS ms, 0 announces each (default 500)\n"
+         << "  --presence-history=on|off  Save presence lines to room history (default on)\n"
+         << "  --help                 Show this help" << endl;
+}
+
+static bool parseArgs(int argc, char *argv[], ServerConfig &config)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        try {
+            if (arg.rfind("--mode=", 0) == 0)
             {
-                string targetUser = msg.substr(7);
-                if (targetUser.empty())
+                string mode = arg.substr(7);
+                if (mode == "threads")
+                    config.mode = ServerMode::Threads;
+                else if (mode == "epoll")
+                    config.mode = ServerMode::Epoll;
+                else
                 {
-                    string err = "Usage: /block <username>\n";
-                    sendAll(clientSocket, err.c_str(), err.size());
-                    continue;
+                    cerr << "Error: Unknown mode '" << mode << "'" << endl;
+                    return false;
                 }
+            }
+            else if (arg.rfind("--io-threads=", 0) == 0)
+            {
+                config.ioThreads = stoi(arg.substr(13));
+                if (config.ioThreads < 1)
                 {
-                    lock_guard<mutex> lock(clientsMutex);
-                    for (auto &c : clients)
-                    {
-                        if (c.socket == clientSocket)
-                        {
-                            if (find(c.blockedUsers.begin(), c.blockedUsers.end(), targetUser) != c.blockedUsers.end())
-                            {
-                                string msg = "User '" + targetUser + "' is already blocked.\n";
-                                sendAll(clientSocket, msg.c_str(), msg.size());
-                            }
-                            else
-                            {
-                                c.blockedUsers.push_back(targetUser);
-                                string msg = "Blocked user '" + targetUser + "'.\n";
-                                sendAll(clientSocket, msg.c_str(), msg.size());
-                            }
-                            break;
-                        }
-                    }
+                    cerr << "Error: --io-threads must be at least 1" << endl;
+                    return false;
                 }
-                continue;
             }
-
-            if (msg.rfind("/unblock ", 0) == 0)
+            else if (arg.rfind("--listeners=", 0) == 0)
             {
-                string targetUser = msg.substr(9);
-                if (targetUser.empty())
+                config.listeners = stoi(arg.substr(12));
+                if (config.listeners < 1)
                 {
-                    string err = "Usage: /unblock <username>\n";
-                    sendAll(clientSocket, err.c_str(), err.size());
-                    continue;
+                    cerr << "Error: --listeners must be at least 1" << endl;
+                    return false;
                 }
+            }
+            else if (arg.rfind("--backlog=", 0) == 0)
+            {
+                config.backlog = stoi(arg.substr(10));
+                if (config.backlog < 1)
                 {
-                    lock_guard<mutex> lock(clientsMutex);
-                    for (auto &c : clients)
-                    {
-                        if (c.socket == clientSocket)
-                        {
-                            auto it = find(c.blockedUsers.begin(), c.blockedUsers.end(), targetUser);
-                            if (it != c.blockedUsers.end())
-                            {
-                                c.blockedUsers.erase(it);
-                                string msg = "Unblocked user '" + targetUser + "'.\n";
-                                sendAll(clientSocket, msg.c_str(), msg.size());
-                            }
-                            else
-                            {
-                                string msg = "User '" + targetUser + "' is not blocked.\n";
-                                sendAll(clientSocket, msg.c_str(), msg.size());
-                            }
-                            break;
-                        }
-                    }
+                    cerr << "Error: --backlog must be at least 1" << endl;
+                    return false;
                 }
-                continue;
             }
-
-            if (msg == "/blocklist")
+            else if (arg.rfind("--accept-batch=", 0) == 0)
             {
-                lock_guard<mutex> lock(clientsMutex);
-                for (auto &c : clients)
+                config.acceptBatch = stoi(arg.substr(15));
+                if (config.acceptBatch < 1)
                 {
-                    if (c.socket == clientSocket)
-                    {
-                        if (c.blockedUsers.empty())
-                        {
-                            string msg = "You have no blocked users.\n";
-                            sendAll(clientSocket, msg.c_str(), msg.size());
-                        }
-                        else
-                        {
-                            string msg = "Blocked users:\n";
-                            for (const auto &u : c.blockedUsers)
-                                msg += " - " + u + "\n";
-                            sendAll(clientSocket, msg.c_str(), msg.size());
-                        }
-                        break;
-                    }
+                    cerr << "Error: --accept-batch must be at least 1" << endl;
+                    return false;
                 }
-                continue;
             }
-
-            if (msg.rfind("/pin ", 0) == 0)
+            else if (arg.rfind("--cpus=", 0) == 0)
             {
-                string room = getClientRoom(clientSocket);
-                string text = msg.substr(5);
-                if (text.empty())
+                config.cpus.clear();
+                stringstream ss(arg.substr(7));
+                string cpu;
+                long cores = sysconf(_SC_NPROCESSORS_CONF);
+                int limit = cores > 0 && cores < CPU_SETSIZE ? static_cast<int>(cores) : CPU_SETSIZE;
+                while (getline(ss, cpu, ','))
                 {
-                    string err = "Usage: /pin <message>\n";
-                    sendAll(clientSocket, err.c_str(), err.size());
-                    continue;
+                    int index = stoi(cpu);
+                    if (index < 0 || index >= limit)
+                    {
+                        cerr << "Error: --cpus entries must be between 0 and " << limit - 1 << endl;
+                        return false;
+                    }
+                    config.cpus.push_back(index);
                 }
-                ensureHistoryDir();
-                string formatted = "📌 [" + nowTimestamp() + "] " + username + ": " + text;
+            }
+            else if (arg.rfind("--queue-high=", 0) == 0)
+            {
+                config.queueHighWatermark = stoul(arg.substr(13));
+            }
+            else if (arg.rfind("--queue-low=", 0) == 0)
+            {
+                config.queueLowWatermark = stoul(arg.substr(12));
+            }
+            else if (arg.rfind("--slow-policy=", 0) == 0)
+            {
+                string policy = arg.substr(14);
+                if (policy == "drop-oldest")
+                    config.slowPolicy = SlowConsumerPolicy::DropOldest;
+                else if (policy == "drop-new")
+                    config.slowPolicy = SlowConsumerPolicy::DropNew;
+                else if (policy == "disconnect")
+                    config.slowPolicy = SlowConsumerPolicy::Disconnect;
+                else
                 {
-                    ofstream pf("history/pins_" + room + ".txt", ios::app);
-                    if (pf.is_open()) pf << formatted << endl;
+                    cerr << "Error: Unknown slow-consumer policy '" << policy << "'" << endl;
+                    return false;
                 }
-                string notice = "[" + nowTimestamp() + "] " + username + " pinned a message.";
-                broadcastMessage(notice, -1, room);
-                sendAll(clientSocket, "Pinned.\n", 8);
-                continue;
             }
-
-            if (msg == "/pins")
+            else if (arg.rfind("--history-sync=", 0) == 0)
             {
-                string room = getClientRoom(clientSocket);
-                ensureHistoryDir();
-                ifstream pf("history/pins_" + room + ".txt");
-                if (!pf.is_open())
+                string sync = arg.substr(15);
+                auto endsWith = [&sync](const string &suffix) {
+                    return sync.size() > suffix.size() && sync.compare(sync.size() - suffix.size(), suffix.size(), suffix) == 0;
+                };
+                if (sync == "none")
+                    config.history.sync = HistorySync::None;
+                else if (endsWith("msgs"))
                 {
-                    string none = "No pins yet.\n";
-                    sendAll(clientSocket, none.c_str(), none.size());
-                    continue;
+                    config.history.sync = HistorySync::Count;
+                    config.history.syncEveryMessages = stoi(sync.substr(0, sync.size() - 4));
                 }
-                string line;
-                string header = "Pinned messages in '" + room + "':\n";
-                sendAll(clientSocket, header.c_str(), header.size());
-                int idx = 1;
-                while (getline(pf, line))
+                else if (endsWith("ms"))
                 {
-                    string entry = to_string(idx++) + ". " + line + "\n";
-                    sendAll(clientSocket, entry.c_str(), entry.size());
+                    config.history.sync = HistorySync::Interval;
+                    config.history.syncIntervalMs = stoi(sync.substr(0, sync.size() - 2));
+                }
+                else
+                {
+                    cerr << "Error: Unknown history sync policy '" << sync << "'" << endl;
+                    return false;
+                }
+                if (config.history.syncEveryMessages < 1 || config.history.syncIntervalMs < 1)
+                {
+                    cerr << "Error: --history-sync needs a positive count" << endl;
+                    return false;
                 }
-                continue;
             }
-
-            if (msg.rfind("/unpin ", 0) == 0)
+            else if (arg.rfind("--history-replay=", 0) == 0)
+            {
+                config.historyReplay = stoul(arg.substr(17));
+            }
+            else if (arg.rfind("--segment-size=", 0) == 0)
             {
-                string room = getClientRoom(clientSocket);
-                string idxStr = msg.substr(7);
-                int idx = 0;
-                try { idx = stoi(idxStr); } catch (...) { idx = 0; }
-                if (idx <= 0)
+                config.history.segmentBytes = stoul(arg.substr(15));
+                if (config.history.segmentBytes < 4096)
                 {
-                    string err = "Usage: /unpin <index>\n";
-                    sendAll(clientSocket, err.c_str(), err.size());
-                    continue;
+                    cerr << "Error: --segment-size must be at least 4096" << endl;
+                    return false;
                 }
-                ensureHistoryDir();
-                string path = "history/pins_" + room + ".txt";
-                ifstream pf(path);
-                if (!pf.is_open())
+            }
+            else if (arg.rfind("--segments=", 0) == 0)
+            {
+                config.history.maxSegments = stoul(arg.substr(11));
+                if (config.history.maxSegments < 1)
                 {
-                    string none = "No pins to unpin.\n";
-                    sendAll(clientSocket, none.c_str(), none.size());
-                    continue;
+                    cerr << "Error: --segments must be at least 1" << endl;
+                    return false;
                 }
-                vector<string> all;
-                string line;
-                while (getline(pf, line)) all.push_back(line);
-                pf.close();
-                if (idx > (int)all.size())
+            }
+            else if (arg.rfind("--cache-room=", 0) == 0)
+            {
+                config.cacheRoomBytes = stoul(arg.substr(13));
+            }
+            else if (arg.rfind("--cache-total=", 0) == 0)
+            {
+                config.cacheBytes = stoul(arg.substr(14));
+            }
+            else if (arg.rfind("--rate=", 0) == 0)
+            {
+                config.rateLimit.perSecond = stod(arg.substr(7));
+            }
+            else if (arg.rfind("--burst=", 0) == 0)
+            {
+                config.rateLimit.burst = stod(arg.substr(8));
+                if (config.rateLimit.burst < 1)
                 {
-                    string err = "Invalid index.\n";
-                    sendAll(clientSocket, err.c_str(), err.size());
-                    continue;
+                    cerr << "Error: --burst must be at least 1" << endl;
+                    return false;
                 }
-                all.erase(all.begin() + (idx - 1));
-                ofstream wf(path, ios::trunc);
-                for (auto &l : all) wf << l << "\n";
-                string ok = "Unpinned #" + to_string(idx) + ".\n";
-                sendAll(clientSocket, ok.c_str(), ok.size());
-                continue;
             }
-
-            if (msg.rfind("/pm ", 0) == 0)
+            else if (arg.rfind("--metrics-port=", 0) == 0)
             {
-                string rest = msg.substr(4);
-                size_t space = rest.find(' ');
-                if (space == string::npos)
+                config.metricsPort = stoi(arg.substr(15));
+                if (config.metricsPort < 1 || config.metricsPort > 65535)
                 {
-                    string err = "Usage: /pm <username> <message>\n";
-                    sendAll(clientSocket, err.c_str(), err.size());
-                    continue;
+                    cerr << "Error: --metrics-port must be between 1 and 65535" << endl;
+                    return false;
                 }
-                string targetUser = rest.substr(0, space);
-                string privateMsg = rest.substr(space + 1);
-                sendPrivateMessage(username, targetUser, privateMsg);
-                continue;
             }
-
-            if (isRateLimited(clientSocket))
+            else if (arg.rfind("--parallel-fanout=", 0) == 0)
             {
-                string warn = "⚠️ Rate limit exceeded. Slow down!\n";
-                sendAll(clientSocket, warn.c_str(), warn.size());
-                continue;
+                config.parallelFanout = stoul(arg.substr(18));
             }
-
-            // Room slowmode check
+            else if (arg.rfind("--fanout-threads=", 0) == 0)
             {
-                string room = getClientRoom(clientSocket);
-                int slowSeconds = 0;
+                config.fanoutThreads = stoi(arg.substr(17));
+                if (config.fanoutThreads < 1)
                 {
-                    lock_guard<mutex> lock(clientsMutex);
-                    auto it = roomSlowmodeSeconds.find(room);
-                    if (it != roomSlowmodeSeconds.end()) slowSeconds = it->second;
+                    cerr << "Error: --fanout-threads must be at least 1" << endl;
+                    return false;
                 }
-                if (slowSeconds > 0)
+            }
+            else if (arg.rfind("--handshake-timeout=", 0) == 0)
+            {
+                config.handshakeTimeout = stoi(arg.substr(20));
+                if (config.handshakeTimeout < 0)
                 {
-                    bool blocked = false;
-                    long remaining = 0;
-                    {
-                        lock_guard<mutex> lock(clientsMutex);
-                        for (auto &c : clients)
-                        {
-                            if (c.socket == clientSocket)
-                            {
-                                auto now = chrono::steady_clock::now();
-                                auto diff = chrono::duration_cast<chrono::seconds>(now - c.lastMsgTime).count();
-                                if (diff < slowSeconds)
-                                {
-                                    blocked = true;
-                                    remaining = slowSeconds - diff;
-                                }
-                                else
-                                {
-                                    c.lastMsgTime = now; // reuse existing timestamp for slowmode window
-                                }
-                                break;
-                            }
-                        }
-                    }
-                    if (blocked)
-                    {
-                        string warn = "⌛ Slowmode is on (" + to_string(slowSeconds) + "s). Wait " + to_string(remaining) + "s.\n";
-                        sendAll(clientSocket, warn.c_str(), warn.size());
-                        continue;
-                    }
+                    cerr << "Error: --handshake-timeout must not be negative" << endl;
+                    return false;
                 }
             }
-
-            string formatted = "[" + nowTimestamp() + "] " + username + ": " + msg;
-            cout << COLOR_BLUE << "💬 " << COLOR_RESET << formatted << endl;
-            broadcastMessage(formatted, clientSocket, getClientRoom(clientSocket));
-            saveMessage(getClientRoom(clientSocket), formatted);
-        }
-    }
-
-    string getClientRoom(int sock)
-    {
-        lock_guard<mutex> lock(clientsMutex);
-        for (auto &c : clients)
-            if (c.socket == sock)
-                return c.room;
-        return "general";
-    }
-
-    void sendPrivateMessage(const string &fromUser, const string &toUser, const string &msg)
-    {
-        lock_guard<mutex> lock(clientsMutex);
-        int fromSock = -1;
-        for (auto &c : clients)
-        {
-            if (c.name == fromUser) fromSock = c.socket;
-        }
-        for (auto &c : clients)
-        {
-            if (c.name == toUser)
+            else if (arg.rfind("--idle-timeout=", 0) == 0)
             {
-                // Check if receiver has blocked sender
-                bool isBlocked = find(c.blockedUsers.begin(), c.blockedUsers.end(), fromUser) != c.blockedUsers.end();
-                
-                if (isBlocked)
+                config.idleTimeout = stoi(arg.substr(15));
+                if (config.idleTimeout < 0)
                 {
-                    if (fromSock != -1)
-                    {
-                        string notice = "Cannot send message: user has blocked you.\n";
-                        sendAll(fromSock, notice.c_str(), notice.size());
-                    }
-                    return;
+                    cerr << "Error: --idle-timeout must not be negative" << endl;
+                    return false;
                 }
-                
-                string formatted = "[PM from " + fromUser + "] " + msg + "\n";
-                sendAll(c.socket, formatted.c_str(), formatted.size());
-                return;
             }
-        }
-        if (fromSock != -1)
-        {
-            string notice = "User '" + toUser + "' is not online.\n";
-            sendAll(fromSock, notice.c_str(), notice.size());
-        }
-    }
-
-    void broadcastMessage(const string &message, int senderSocket, const string &room)
-    {
-        lock_guard<mutex> lock(clientsMutex);
-        
-        // Get sender's username
-        string senderName;
-        for (const auto &c : clients)
-        {
-            if (c.socket == senderSocket)
+            else if (arg.rfind("--keepalive=", 0) == 0)
             {
-                senderName = c.name;
-                break;
+                config.keepalive = stoi(arg.substr(12));
+                if (config.keepalive < 0)
+                {
+                    cerr << "Error: --keepalive must not be negative" << endl;
+                    return false;
+                }
             }
-        }
-        
-        for (auto it = clients.begin(); it != clients.end();)
-        {
-            if (it->room == room && it->socket != senderSocket)
+            else if (arg.rfind("--presence-window=", 0) == 0)
             {
-                // Check if receiver has blocked the sender
-                bool isBlocked = find(it->blockedUsers.begin(), it->blockedUsers.end(), senderName) != it->blockedUsers.end();
-                
-                if (!isBlocked)
+                config.presenceWindowMs = stoi(arg.substr(18));
+                if (config.presenceWindowMs < 0)
                 {
-                    bool ok = sendAll(it->socket, message.c_str(), message.size()) &&
-                              sendAll(it->socket, "\n", 1);
-                    if (!ok)
-                    {
-                        close(it->socket);
-                        it = clients.erase(it);
-                        continue;
-                    }
+                    cerr << "Error: --presence-window must not be negative" << endl;
+                    return false;
                 }
             }
-            ++it;
-        }
-    }
-
-    void removeClient(int clientSocket)
-    {
-        lock_guard<mutex> lock(clientsMutex);
-        clients.erase(remove_if(clients.begin(), clients.end(),
-                                [clientSocket](const ClientInfo &c)
-                                { return c.socket == clientSocket; }),
-                      clients.end());
-    }
-
-    void kickUser(const string &username)
-    {
-        lock_guard<mutex> lock(clientsMutex);
-        for (auto it = clients.begin(); it != clients.end(); ++it)
-        {
-            if (it->name == username)
+            else if (arg.rfind("--presence-history=", 0) == 0)
             {
-                string msg = "[SERVER] You have been kicked by admin.\n";
-                send(it->socket, msg.c_str(), msg.size(), 0);
-                close(it->socket);
-                clients.erase(it);
-                cout << COLOR_RED << "⚠ Kicked user: " << COLOR_RESET << username << endl;
-                return;
+                string value = arg.substr(19);
+                if (value != "on" && value != "off")
+                {
+                    cerr << "Error: --presence-history must be on or off" << endl;
+                    return false;
+                }
+                config.presenceHistory = value == "on";
+            }
+            else if (arg.rfind("--rebalance-ms=", 0) == 0)
+            {
+                config.rebalanceMs = stoi(arg.substr(15));
+                if (config.rebalanceMs < 0)
+                {
+                    cerr << "Error: --rebalance-ms must not be negative" << endl;
+                    return false;
+                }
+            }
+            else if (arg.rfind("--", 0) == 0)
+            {
+                cerr << "Error: Unknown option " << arg << endl;
+                printUsage();
+                return false;
             }
+            else
+            {
+                config.port = stoi(arg);
+                if (config.port < 1 || config.port > 65535)
+                {
+                    cerr << "Error: Port must be between 1 and 65535" << endl;
+                    return false;
+                }
+            }
+        } catch (const exception &e) {
+            if (arg.rfind("--", 0) == 0)
+                cerr << "Error: Invalid value in " << arg << endl;
+            else
+                cerr << "Error: Invalid port number" << endl;
+            return false;
         }
-        cout << COLOR_YELLOW << "⚠ No such user: " << COLOR_RESET << username << endl;
     }
-};
-
-ChatServer *serverInstance = nullptr;
-void signalHandler(int signal)
-{
-    if (signal == SIGINT || signal == SIGTERM)
+    if (config.queueLowWatermark > config.queueHighWatermark)
     {
-        cout << "\n" << COLOR_RED << "⏻ Shutting down server..." << COLOR_RESET << endl;
-        if (serverInstance)
-            serverInstance->stop();
-        exit(0);
+        cerr << "Error: --queue-low must not exceed --queue-high" << endl;
+        return false;
     }
+    return true;
 }
 
 int main(int argc, char *argv[])
 {
-    int port = 8080;
-    if (argc > 1)
+    for (int i = 1; i < argc; ++i)
     {
-        try {
-            port = stoi(argv[1]);
-            if (port < 1 || port > 65535)
-            {
-                cerr << "Error: Port must be between 1 and 65535" << endl;
-                return 1;
-            }
-        } catch (const exception &e) {
-            cerr << "Error: Invalid port number" << endl;
-            return 1;
+        if (string(argv[i]) == "--help")
+        {
+            printUsage();
+            return 0;
         }
     }
+    ServerConfig config;
+    if (!parseArgs(argc, argv, config))
+        return 1;
     try
     {
-        ChatServer server(port);
+        ChatServer server(config);
         serverInstance = &server;
         signal(SIGINT, signalHandler);
         signal(SIGTERM, signalHandler);
@@ -869,4 +2959,5 @@ int main(int argc, char *argv[])
         return 1;
     }
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,297 @@
+#pragma once
+
+// Per-room pin boards.
+//
+// Each board lives in memory as an array in pin order plus an id -> slot map;
+// unpinning only tombstones the slot, so both operations are O(1) however big
+// the board is. Every change is also appended to history/pins/<room>.log as a
+// "P <id> <text>" or "U <id>" record (compaction adds "N <next id>"). The appends and the log compaction run
+// on a background thread handed in by the owner, in the order they were
+// queued, so a compaction snapshot never loses a record queued after it.
+// Pin ids are stable: /unpin names a pin by id, not by its position.
+//
+// The store-wide mutex only guards the room -> board map; each board has its
+// own, so reading one room's log on first touch holds up nobody else. preload()
+// does that read on the background thread before anyone asks for the board.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "room_names.h"
+
+class PinStore
+{
+public:
+    using Background = std::function<void(std::function<void()>)>;
+
+    static constexpr size_t COMPACT_MIN_RECORDS = 64; // small logs are never worth rewriting
+
+    PinStore(std::string directory, Background runInBackground)
+        : dir(std::move(directory)), background(std::move(runInBackground)) {}
+
+    uint64_t pin(const std::string &room, std::string text)
+    {
+        for (char &c : text)
+        {
+            if (c == '\n' || c == '\r')
+                c = ' '; // one record per line in the log
+        }
+        std::shared_ptr<Board> held = boardFor(room);
+        Board &board = *held;
+        std::lock_guard<std::mutex> lock(board.mutex);
+        load(board);
+        uint64_t id = board.nextId++;
+        board.slotOf[id] = board.pins.size();
+        board.pins.push_back(Pin{id, text, true});
+        ++board.live;
+        appendRecord(board, "P " + std::to_string(id) + " " + text + "\n");
+        return id;
+    }
+
+    // False if the board has no live pin with that id
+    bool unpin(const std::string &room, uint64_t id)
+    {
+        std::shared_ptr<Board> held = boardFor(room);
+        Board &board = *held;
+        std::lock_guard<std::mutex> lock(board.mutex);
+        load(board);
+        auto found = board.slotOf.find(id);
+        if (found == board.slotOf.end())
+            return false;
+        Pin &pin = board.pins[found->second];
+        pin.live = false;
+        std::string().swap(pin.text);
+        board.slotOf.erase(found);
+        --board.live;
+        appendRecord(board, "U " + std::to_string(id) + "\n");
+
+        // Tombstones are dropped once they outnumber live pins, which keeps
+        // the sweep amortised O(1) per unpin
+        if (board.pins.size() - board.live > board.live)
+            sweepTombstones(board);
+        if (board.logRecords > COMPACT_MIN_RECORDS && board.logRecords > 2 * board.live)
+            compactLog(board);
+        return true;
+    }
+
+    // Calls visit(id, text) for each live pin, oldest first; returns how many
+    template <typename Visit>
+    size_t forEach(const std::string &room, Visit &&visit)
+    {
+        std::shared_ptr<Board> held = boardFor(room);
+        Board &board = *held;
+        std::lock_guard<std::mutex> lock(board.mutex);
+        load(board);
+        for (const Pin &pin : board.pins)
+        {
+            if (pin.live)
+                visit(pin.id, pin.text);
+        }
+        return board.live;
+    }
+
+    // Queues the first read of the room's log on the background thread, so
+    // the thread serving the room finds the board ready. No-op once the room
+    // has been touched.
+    void preload(const std::string &room)
+    {
+        bool created = false;
+        std::shared_ptr<Board> board = boardFor(room, &created);
+        if (!created)
+            return;
+        background([board] {
+            std::lock_guard<std::mutex> lock(board->mutex);
+            load(*board);
+        });
+    }
+
+private:
+    struct Pin
+    {
+        uint64_t id;
+        std::string text;
+        bool live;
+    };
+
+    struct Board
+    {
+        std::mutex mutex; // held to load the board and for every read or change
+        bool loaded = false;
+        std::string logPath;
+        std::string legacyPath; // empty if the room name could not have had one
+        std::vector<Pin> pins;                       // pin order, tombstones included
+        std::unordered_map<uint64_t, size_t> slotOf; // live id -> index in pins
+        size_t live = 0;
+        uint64_t nextId = 1;
+        size_t logRecords = 0; // records the log file will hold once the background catches up
+    };
+
+    std::string dir;
+    Background background;
+    std::mutex mutex; // guards boards and dirsMade only
+    std::unordered_map<std::string, std::shared_ptr<Board>> boards;
+    bool dirsMade = false;
+
+    // The room's board, not necessarily loaded yet; shared so a queued
+    // preload never outlives it
+    std::shared_ptr<Board> boardFor(const std::string &room, bool *created = nullptr)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<Board> &board = boards[room];
+        if (created)
+            *created = !board;
+        if (board)
+            return board;
+        if (!dirsMade)
+        {
+            mkdir(dir.c_str(), 0755);
+            mkdir((dir + "/pins").c_str(), 0755);
+            dirsMade = true;
+        }
+        board = std::make_shared<Board>();
+        board->logPath = dir + "/pins/" + RoomNames::fileName(room) + ".log";
+        if (RoomNames::valid(room))
+            board->legacyPath = dir + "/pins_" + room + ".txt";
+        return board;
+    }
+
+    // Called with the board's lock held, so queue order matches the in-memory order
+    void appendRecord(Board &board, std::string record)
+    {
+        ++board.logRecords;
+        std::string path = board.logPath;
+        background([path, record] { appendToFile(path, record, O_APPEND); });
+    }
+
+    static void sweepTombstones(Board &board)
+    {
+        size_t out = 0;
+        for (size_t i = 0; i < board.pins.size(); ++i)
+        {
+            if (!board.pins[i].live)
+                continue;
+            if (out != i)
+                board.pins[out] = std::move(board.pins[i]);
+            board.slotOf[board.pins[out].id] = out;
+            ++out;
+        }
+        board.pins.resize(out);
+    }
+
+    // Snapshot the live pins now; the rewrite runs behind every record already queued
+    void compactLog(Board &board)
+    {
+        // The N record keeps ids of compacted-away pins from being handed out again
+        std::string snapshot = "N " + std::to_string(board.nextId) + "\n";
+        for (const Pin &pin : board.pins)
+        {
+            if (pin.live)
+                snapshot += "P " + std::to_string(pin.id) + " " + pin.text + "\n";
+        }
+        board.logRecords = board.live + 1;
+        std::string path = board.logPath;
+        background([path, snapshot] {
+            std::string tmp = path + ".tmp";
+            if (appendToFile(tmp, snapshot, O_TRUNC))
+                rename(tmp.c_str(), path.c_str());
+        });
+    }
+
+    static bool appendToFile(const std::string &path, const std::string &bytes, int mode)
+    {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | mode, 0644);
+        if (fd < 0)
+            return false;
+        size_t done = 0;
+        while (done < bytes.size())
+        {
+            ssize_t n = write(fd, bytes.data() + done, bytes.size() - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        close(fd);
+        return done == bytes.size();
+    }
+
+    // Replays the room's log once per process, with the board's lock held; a
+    // pins_<room>.txt from before the log existed is imported with ids in file order
+    static void load(Board &board)
+    {
+        if (board.loaded)
+            return;
+        board.loaded = true;
+
+        std::ifstream log(board.logPath);
+        std::string line;
+        if (log.is_open())
+        {
+            while (std::getline(log, line))
+            {
+                ++board.logRecords;
+                if (line.size() < 3 || line[1] != ' ')
+                    continue;
+                size_t idEnd = line.find(' ', 2);
+                uint64_t id = std::strtoull(line.c_str() + 2, nullptr, 10);
+                if (id == 0)
+                    continue;
+                if (line[0] == 'P')
+                {
+                    board.slotOf[id] = board.pins.size();
+                    board.pins.push_back(Pin{id, idEnd == std::string::npos ? "" : line.substr(idEnd + 1), true});
+                    ++board.live;
+                }
+                else if (line[0] == 'U')
+                {
+                    auto found = board.slotOf.find(id);
+                    if (found != board.slotOf.end())
+                    {
+                        board.pins[found->second].live = false;
+                        std::string().swap(board.pins[found->second].text);
+                        board.slotOf.erase(found);
+                        --board.live;
+                    }
+                }
+                if (line[0] == 'N')
+                    board.nextId = std::max(board.nextId, id);
+                else
+                    board.nextId = std::max(board.nextId, id + 1);
+            }
+            sweepTombstones(board);
+            return;
+        }
+
+        if (board.legacyPath.empty())
+            return;
+        std::ifstream legacy(board.legacyPath);
+        if (!legacy.is_open())
+            return;
+        std::string records;
+        while (std::getline(legacy, line))
+        {
+            uint64_t id = board.nextId++;
+            board.slotOf[id] = board.pins.size();
+            board.pins.push_back(Pin{id, line, true});
+            ++board.live;
+            records += "P " + std::to_string(id) + " " + line + "\n";
+        }
+        board.logRecords = board.live;
+        if (appendToFile(board.logPath, records, O_TRUNC))
+            unlink(board.legacyPath.c_str());
+    }
+};
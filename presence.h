@@ -0,0 +1,104 @@
+#pragma once
+
+// Join and leave events summed up per room over a short window, so a burst
+// of them goes out as one line per room instead of one broadcast each.
+//
+// Only the net change per user survives: someone who leaves and comes back
+// within the window (most of a reconnect storm) is not announced at all. Every
+// room waits the same window from its first event, so rooms fall due in the
+// order they were opened and a single timer at the front of that queue serves
+// them all. Presence changes are rare next to chat messages, so one mutex is
+// enough.
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class PresenceBatcher
+{
+public:
+    enum class Change { Joined, Left };
+
+    struct Summary
+    {
+        std::string room;
+        std::vector<std::string> joined; // in the order they first showed up
+        std::vector<std::string> left;
+    };
+
+    explicit PresenceBatcher(int64_t windowNs) : window(windowNs) {}
+
+    PresenceBatcher(const PresenceBatcher &) = delete;
+    PresenceBatcher &operator=(const PresenceBatcher &) = delete;
+
+    // Records a change at `now`. True if nothing was pending before, so the
+    // caller has to arm the flush.
+    bool add(const std::string &room, const std::string &name, Change change, int64_t now)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bool idle = due.empty();
+        auto found = pending.find(room);
+        if (found == pending.end())
+        {
+            found = pending.emplace(room, Batch{}).first;
+            due.emplace_back(now + window, room);
+        }
+        Batch &batch = found->second;
+        auto entry = batch.net.emplace(name, 0);
+        if (entry.second)
+            batch.order.push_back(name);
+        entry.first->second += change == Change::Joined ? 1 : -1;
+        return idle;
+    }
+
+    // Takes every room whose window has closed by `now`; rooms where
+    // everything cancelled out are dropped without a summary
+    void takeDue(int64_t now, std::vector<Summary> &out)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        while (!due.empty() && due.front().first <= now)
+        {
+            auto found = pending.find(due.front().second);
+            Summary summary;
+            summary.room = std::move(due.front().second);
+            for (auto &name : found->second.order)
+            {
+                int net = found->second.net[name];
+                if (net > 0)
+                    summary.joined.push_back(name);
+                else if (net < 0)
+                    summary.left.push_back(name);
+            }
+            pending.erase(found);
+            due.pop_front();
+            if (!summary.joined.empty() || !summary.left.empty())
+                out.push_back(std::move(summary));
+        }
+    }
+
+    // When the next room falls due; false if nothing is pending
+    bool nextDue(int64_t &deadline)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (due.empty())
+            return false;
+        deadline = due.front().first;
+        return true;
+    }
+
+private:
+    struct Batch
+    {
+        std::unordered_map<std::string, int> net; // +1 joined, -1 left, 0 back where they started
+        std::vector<std::string> order;
+    };
+
+    int64_t window;
+    std::mutex mutex;
+    std::unordered_map<std::string, Batch> pending;
+    std::deque<std::pair<int64_t, std::string>> due; // deadline and room, oldest first
+};
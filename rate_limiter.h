@@ -0,0 +1,77 @@
+#pragma once
+
+// Per-session token buckets on a single atomic each.
+//
+// The bucket is kept in GCRA form: rather than a token count plus a refill
+// time it stores the time the next message is "due" (TAT). A message may
+// pass when it arrives no earlier than TAT minus the burst allowance, and
+// passing moves TAT one emission interval on. That is exactly a bucket of
+// `burst` tokens refilled at `perSecond`, but the whole state is one int64
+// advanced by compare-and-swap, so a check never takes a lock and the limit
+// it is checked against may change between calls.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+struct RateLimit
+{
+    double perSecond = 0; // sustained rate; 0 or less disables the limit
+    double burst = 1;     // messages that may arrive back to back
+
+    bool unlimited() const
+    {
+        return perSecond <= 0;
+    }
+};
+
+class TokenBucket
+{
+public:
+    static int64_t nowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Takes a token if one is available at `now`
+    bool tryTake(const RateLimit &limit, int64_t now)
+    {
+        if (limit.unlimited())
+            return true;
+        int64_t interval, tolerance;
+        spacing(limit, interval, tolerance);
+        int64_t due = next.load(std::memory_order_relaxed);
+        while (true)
+        {
+            int64_t base = std::max(due, now);
+            if (base - tolerance > now)
+                return false;
+            if (next.compare_exchange_weak(due, base + interval, std::memory_order_relaxed))
+                return true;
+        }
+    }
+
+    // Nanoseconds until tryTake would succeed, 0 if it would now
+    int64_t waitNs(const RateLimit &limit, int64_t now) const
+    {
+        if (limit.unlimited())
+            return 0;
+        int64_t interval, tolerance;
+        spacing(limit, interval, tolerance);
+        int64_t wait = next.load(std::memory_order_relaxed) - tolerance - now;
+        return wait > 0 ? wait : 0;
+    }
+
+private:
+    std::atomic<int64_t> next{0}; // TAT in steady-clock nanoseconds
+
+    // Emission interval and burst allowance in nanoseconds, capped so tiny rates cannot overflow
+    static void spacing(const RateLimit &limit, int64_t &interval, int64_t &tolerance)
+    {
+        const double maxNs = 1e15; // about 11 days
+        interval = static_cast<int64_t>(std::min(1e9 / limit.perSecond, maxNs));
+        tolerance = static_cast<int64_t>(std::min((std::max(limit.burst, 1.0) - 1) * interval, maxNs));
+    }
+};
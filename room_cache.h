@@ -0,0 +1,323 @@
+#pragma once
+
+// In-memory cache of each active room's most recent messages.
+//
+// Every cached room owns one preallocated byte ring plus a fixed array of
+// (offset, length) slots, so appending a message is a memcpy and never an
+// allocation. Old messages fall off when either fills up.
+//
+// Each ring has its own mutex and rings hang off SHARDS room-keyed maps, so
+// rooms on different threads never meet on a lock. Only creating a ring takes
+// the budget lock: rooms are evicted least recently used first once the global
+// budget is spent, judged by the creation epoch each ring last saw traffic in.
+//
+// A new ring is seeded once with the room's stored tail through the callback
+// given to the constructor, and serves replays from then on (or once it has
+// filled a window by itself, whichever comes first).
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "tracing.h"
+
+class RoomCache
+{
+public:
+    static constexpr size_t SHARDS = 16;
+
+    // Called once per new ring, before anyone can append to it: arrange for
+    // seed(room, id, ...) to be called with what was stored before this point
+    using Seeder = std::function<void(const std::string &room, uint64_t id)>;
+
+    // messagesPerRoom is the replay window; 0 bytes in either limit disables the cache
+    RoomCache(size_t messagesPerRoom, size_t bytesPerRoom, size_t bytesTotal, Seeder seeder)
+        : maxMessages(messagesPerRoom), roomBytes(bytesPerRoom), totalBytes(bytesTotal), seedFrom(std::move(seeder)) {}
+
+    void append(const std::string &room, const std::string &message)
+    {
+        if (maxMessages == 0 || roomBytes == 0)
+            return;
+        std::shared_ptr<Ring> ring = find(room);
+        if (message.size() > roomBytes)
+        {
+            // Cannot hold it, so the ring would replay a gap; let the disk answer instead
+            if (ring)
+                evict(room, ring);
+            return;
+        }
+        if (!ring)
+            ring = create(room);
+        if (!ring)
+            return;
+        Trace::TimedLock<std::mutex> lock(ring->mutex, "wait cache", "hold cache");
+        ring->push(message.data(), message.size());
+        ring->lastUse = useEpoch.load(std::memory_order_relaxed);
+    }
+
+    // Calls visit(data, len) for up to `count` recent messages, oldest first.
+    // False when the room is not cached well enough to answer; nothing was
+    // visited then. A miss on a room with no ring starts one.
+    template <typename Visit>
+    bool forEachRecent(const std::string &room, size_t count, Visit &&visit)
+    {
+        if (maxMessages == 0 || roomBytes == 0)
+            return false;
+        std::shared_ptr<Ring> ring = find(room);
+        if (!ring)
+        {
+            create(room);
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        Trace::TimedLock<std::mutex> lock(ring->mutex, "wait cache", "hold cache");
+        if (!ring->covered)
+        {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        hits.fetch_add(1, std::memory_order_relaxed);
+        ring->lastUse = useEpoch.load(std::memory_order_relaxed);
+        size_t skip = ring->count > count ? ring->count - count : 0;
+        for (size_t i = skip; i < ring->count; ++i)
+        {
+            const Slot &slot = ring->slots[(ring->first + i) % maxMessages];
+            visit(ring->bytes.get() + slot.offset, slot.length);
+        }
+        return true;
+    }
+
+    // The room's stored messages up to the point ring `id` was created,
+    // oldest first. Goes in front of whatever the ring took since; ignored if
+    // the room has had another ring since then.
+    void seed(const std::string &room, uint64_t id, const std::vector<std::string> &stored)
+    {
+        std::shared_ptr<Ring> ring = find(room);
+        if (!ring || ring->id != id)
+            return;
+        std::lock_guard<std::mutex> lock(ring->mutex);
+        if (ring->covered)
+            return; // filled a window on its own already
+        for (const std::string &line : stored)
+        {
+            if (line.size() > roomBytes)
+                return; // would leave a gap; stay unseeded and let the disk answer
+        }
+        std::vector<std::string> since;
+        for (size_t i = 0; i < ring->count; ++i)
+        {
+            const Slot &slot = ring->slots[(ring->first + i) % maxMessages];
+            since.emplace_back(ring->bytes.get() + slot.offset, slot.length);
+        }
+        ring->first = ring->count = ring->writePos = 0;
+        for (const std::string &line : stored)
+            ring->push(line.data(), line.size());
+        for (const std::string &line : since)
+            ring->push(line.data(), line.size());
+        ring->covered = true;
+    }
+
+    struct Stats
+    {
+        size_t rooms;
+        size_t bytesReserved;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+    };
+
+    Stats stats()
+    {
+        std::lock_guard<std::mutex> lock(budgetMutex);
+        return Stats{ringCount, reserved, hits.load(), misses.load(), evictions};
+    }
+
+private:
+    struct Slot
+    {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    // Messages are stored unsplit: one that does not fit before the end of
+    // the buffer starts over at offset 0
+    struct Ring
+    {
+        std::mutex mutex;      // guards everything below but id and lastUse
+        std::unique_ptr<char[]> bytes;
+        std::unique_ptr<Slot[]> slots;
+        size_t capacity = 0;   // bytes
+        size_t maxSlots = 0;
+        size_t first = 0;      // slot of the oldest message
+        size_t count = 0;
+        size_t writePos = 0;   // byte offset just past the newest message
+        bool covered = false;  // seeded, holds a full window, or has had to drop messages
+        uint64_t id;
+        std::atomic<uint64_t> lastUse; // creation epoch of the latest append or hit
+
+        Ring(size_t bytesCap, size_t slotCap, uint64_t ringId, uint64_t epoch)
+            : bytes(new char[bytesCap]), slots(new Slot[slotCap]), capacity(bytesCap), maxSlots(slotCap), id(ringId),
+              lastUse(epoch) {}
+        void push(const char *data, size_t len)
+        {
+            if (count == maxSlots)
+                dropOldest();
+            size_t pos;
+            while (!fits(len, pos))
+                dropOldest();
+            memcpy(bytes.get() + pos, data, len);
+            slots[(first + count) % maxSlots] = Slot{static_cast<uint32_t>(pos), static_cast<uint32_t>(len)};
+            ++count;
+            writePos = pos + len;
+            if (count == maxSlots)
+                covered = true;
+        }
+
+        // Where `len` bytes can go without touching live messages
+        bool fits(size_t len, size_t &pos) const
+        {
+            if (count == 0)
+            {
+                pos = 0;
+                return true;
+            }
+            size_t head = slots[first].offset;
+            if (writePos > head)
+            {
+                // Live bytes are [head, writePos): free space at the end, then before head
+                if (writePos + len <= capacity)
+                {
+                    pos = writePos;
+                    return true;
+                }
+                pos = 0;
+                return len <= head;
+            }
+            // Live bytes wrapped: the only gap is [writePos, head)
+            pos = writePos;
+            return writePos + len <= head;
+        }
+
+        void dropOldest()
+        {
+            first = (first + 1) % maxSlots;
+            --count;
+            covered = true;
+            if (count == 0)
+                writePos = 0;
+        }
+    };
+
+    struct alignas(64) Shard
+    {
+        std::mutex mutex; // held only to look a ring up, add or remove it
+        std::unordered_map<std::string, std::shared_ptr<Ring>> rings;
+    };
+
+    size_t maxMessages;
+    size_t roomBytes;
+    size_t totalBytes;
+    Seeder seedFrom;
+
+    Shard shards[SHARDS];
+    std::mutex budgetMutex; // creation and eviction; taken before a Shard mutex, never after
+    size_t reserved = 0;
+    size_t ringCount = 0;
+    uint64_t nextId = 0;
+    uint64_t evictions = 0;
+    std::atomic<uint64_t> useEpoch{0}; // bumped by every creation
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+    Shard &shardFor(const std::string &room)
+    {
+        return shards[std::hash<std::string>()(room) % SHARDS];
+    }
+
+    std::shared_ptr<Ring> find(const std::string &room)
+    {
+        Shard &shard = shardFor(room);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.rings.find(room);
+        return it == shard.rings.end() ? nullptr : it->second;
+    }
+
+    // Removes the room's ring if it is still `ring`; threads still holding it finish on the orphan
+    void evict(const std::string &room, const std::shared_ptr<Ring> &ring)
+    {
+        std::lock_guard<std::mutex> budget(budgetMutex);
+        Shard &shard = shardFor(room);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.rings.find(room);
+        if (it == shard.rings.end() || it->second != ring)
+            return;
+        shard.rings.erase(it);
+        reserved -= roomBytes;
+        --ringCount;
+        ++evictions;
+    }
+
+    // Budget lock held: drops the ring that has gone longest without traffic
+    bool evictLeastRecent()
+    {
+        Shard *victimShard = nullptr;
+        std::string victim;
+        uint64_t oldest = UINT64_MAX;
+        for (Shard &shard : shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (auto &entry : shard.rings)
+            {
+                uint64_t used = entry.second->lastUse.load(std::memory_order_relaxed);
+                if (used < oldest)
+                {
+                    oldest = used;
+                    victim = entry.first;
+                    victimShard = &shard;
+                }
+            }
+        }
+        if (!victimShard)
+            return false;
+        std::lock_guard<std::mutex> lock(victimShard->mutex);
+        victimShard->rings.erase(victim);
+        reserved -= roomBytes;
+        --ringCount;
+        ++evictions;
+        return true;
+    }
+
+    std::shared_ptr<Ring> create(const std::string &room)
+    {
+        if (roomBytes > totalBytes)
+            return nullptr;
+        std::lock_guard<std::mutex> budget(budgetMutex);
+        if (std::shared_ptr<Ring> raced = find(room))
+            return raced;
+        while (reserved + roomBytes > totalBytes && evictLeastRecent())
+        {
+        }
+        uint64_t epoch = useEpoch.fetch_add(1, std::memory_order_relaxed) + 1;
+        auto ring = std::make_shared<Ring>(roomBytes, maxMessages, ++nextId, epoch);
+        reserved += roomBytes;
+        ++ringCount;
+
+        // Seeded before it is published, so nothing appended to it can also be in the seed
+        std::lock_guard<std::mutex> ringLock(ring->mutex);
+        {
+            Shard &shard = shardFor(room);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.rings.emplace(room, ring);
+        }
+        if (seedFrom)
+            seedFrom(room, ring->id);
+        return ring;
+    }
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+// Room names come straight from clients and end up in file names (history
+// segments, pin logs), so /join checks them and the stores encode them before
+// building a path.
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace RoomNames
+{
+    constexpr size_t MAX_LENGTH = 64; // bytes
+
+    // No path separators, no "..", nothing unprintable, not too long
+    inline bool valid(std::string_view room)
+    {
+        if (room.empty() || room.size() > MAX_LENGTH)
+            return false;
+        if (room.find('/') != std::string_view::npos || room.find("..") != std::string_view::npos)
+            return false;
+        for (char c : room)
+        {
+            auto byte = static_cast<unsigned char>(c);
+            if (byte < 0x20 || byte == 0x7f)
+                return false;
+        }
+        return true;
+    }
+
+    // One path component that cannot escape its directory: letters, digits,
+    // '-' and '_' stay as they are, every other byte becomes %XX
+    inline std::string fileName(std::string_view room)
+    {
+        static const char HEX[] = "0123456789ABCDEF";
+        std::string out;
+        out.reserve(room.size());
+        for (char c : room)
+        {
+            auto byte = static_cast<unsigned char>(c);
+            if ((byte >= 'a' && byte <= 'z') || (byte >= 'A' && byte <= 'Z') || (byte >= '0' && byte <= '9') ||
+                byte == '-' || byte == '_')
+            {
+                out += c;
+                continue;
+            }
+            out += '%';
+            out += HEX[byte >> 4];
+            out += HEX[byte & 15];
+        }
+        return out;
+    }
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+// Which reactor loop owns each room.
+//
+// In epoll mode every member of a room is served by the loop that owns it,
+// so a room's fan-out only writes to sockets of its own thread and never
+// meets another core on a client's write lock. A new room goes to the loop
+// with the fewest members; rebalance() moves a busy room away from a loop
+// that carries far more traffic than the others. Placement only changes on
+// joins, leaves and rebalancing, so one mutex is enough: nothing on the
+// message path reads it.
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class RoomScheduler
+{
+public:
+    struct Move
+    {
+        std::string room;
+        size_t from = 0;
+        size_t to = 0;
+        uint64_t traffic = 0; // the room's share of the window that triggered the move
+    };
+
+    // With 0 workers nothing is placed and ownerOf() never finds an owner
+    explicit RoomScheduler(size_t workers) : workerMembers(workers, 0) {}
+
+    RoomScheduler(const RoomScheduler &) = delete;
+    RoomScheduler &operator=(const RoomScheduler &) = delete;
+
+    size_t workers() const
+    {
+        return workerMembers.size();
+    }
+
+    // Counts a member into the room, placing the room if it is new
+    void join(const std::string &room)
+    {
+        if (workerMembers.empty())
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = rooms.find(room);
+        if (found == rooms.end())
+            found = rooms.emplace(room, Placement{leastMembersLocked(), 0}).first;
+        ++found->second.members;
+        ++workerMembers[found->second.worker];
+    }
+
+    // The last one out forgets the room, so it is placed afresh next time
+    void leave(const std::string &room)
+    {
+        if (workerMembers.empty())
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = rooms.find(room);
+        if (found == rooms.end())
+            return;
+        --workerMembers[found->second.worker];
+        if (--found->second.members == 0)
+            rooms.erase(found);
+    }
+
+    // False if the room has no members (or placement is off)
+    bool ownerOf(const std::string &room, size_t &worker)
+    {
+        if (workerMembers.empty())
+            return false;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = rooms.find(room);
+        if (found == rooms.end())
+            return false;
+        worker = found->second.worker;
+        return true;
+    }
+
+    // Given each room's traffic since the last call, moves one room from the
+    // busiest worker to the idlest if the busiest carries more than `skew`
+    // times the average. The room picked is the one that best evens the two
+    // out; a single room hotter than the gap stays where it is. One move per
+    // call keeps placement from flapping.
+    bool rebalance(const std::unordered_map<std::string, uint64_t> &traffic, double skew, Move &move)
+    {
+        if (workerMembers.size() < 2)
+            return false;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<uint64_t> load(workerMembers.size(), 0);
+        uint64_t total = 0;
+        for (auto &entry : traffic)
+        {
+            auto found = rooms.find(entry.first);
+            if (found == rooms.end())
+                continue;
+            load[found->second.worker] += entry.second;
+            total += entry.second;
+        }
+        size_t busiest = 0, idlest = 0;
+        for (size_t w = 1; w < load.size(); ++w)
+        {
+            if (load[w] > load[busiest])
+                busiest = w;
+            if (load[w] < load[idlest])
+                idlest = w;
+        }
+        double average = static_cast<double>(total) / load.size();
+        if (total == 0 || load[busiest] <= skew * average)
+            return false;
+
+        uint64_t gap = load[busiest] - load[idlest];
+        uint64_t bestBalance = 0;
+        for (auto &entry : traffic)
+        {
+            auto found = rooms.find(entry.first);
+            if (found == rooms.end() || found->second.worker != busiest)
+                continue;
+            uint64_t t = entry.second;
+            if (t == 0 || t >= gap)
+                continue;
+            uint64_t balance = t < gap - t ? t : gap - t; // how much closer the two get
+            if (balance > bestBalance)
+            {
+                bestBalance = balance;
+                move = Move{entry.first, busiest, idlest, t};
+            }
+        }
+        if (bestBalance == 0)
+            return false;
+
+        Placement &placement = rooms.at(move.room);
+        workerMembers[busiest] -= placement.members;
+        workerMembers[idlest] += placement.members;
+        placement.worker = idlest;
+        return true;
+    }
+
+    // Rooms and members per worker, for the admin console
+    void snapshot(std::vector<size_t> &roomCount, std::vector<size_t> &memberCount)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        roomCount.assign(workerMembers.size(), 0);
+        memberCount = workerMembers;
+        for (auto &entry : rooms)
+            ++roomCount[entry.second.worker];
+    }
+
+private:
+    struct Placement
+    {
+        size_t worker;
+        size_t members;
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Placement> rooms;
+    std::vector<size_t> workerMembers; // members of the rooms each worker owns
+
+    size_t leastMembersLocked() const
+    {
+        size_t best = 0;
+        for (size_t w = 1; w < workerMembers.size(); ++w)
+        {
+            if (workerMembers[w] < workerMembers[best])
+                best = w;
+        }
+        return best;
+    }
+};
@@ -0,0 +1,226 @@
+#pragma once
+
+// Hierarchical timer wheel for one event loop.
+//
+// Time is cut into ticks. Level 0 has a slot per tick for the next 64 ticks,
+// each higher level a slot per 64 ticks of the level below, so four levels
+// cover about 16.7M ticks. Arming and cancelling a timer is a list link or
+// unlink; a timer is only touched again when its level-0 slot comes due or
+// when the slot it waits in at a higher level cascades down one level, which
+// happens at most once per level. Timers are intrusive, so a loop holding
+// 100k of them allocates nothing per arm. Not thread-safe: only the owning
+// loop's thread may touch the wheel or its timers.
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+class TimerWheel
+{
+public:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 6;
+    static constexpr uint64_t SLOTS = 1 << SLOT_BITS;
+    static constexpr uint64_t MAX_TICKS = uint64_t(1) << (SLOT_BITS * LEVELS); // farther deadlines are re-placed on the way
+
+    struct Link
+    {
+        Link *prev = nullptr;
+        Link *next = nullptr;
+    };
+
+    // Embedded in whatever it times; destroy it only once cancelled or fired
+    class Timer : private Link
+    {
+    public:
+        Timer() = default;
+        explicit Timer(std::function<void()> cb) : callback(std::move(cb)) {}
+
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+        // Called on expiry, on the loop thread. It may arm this timer again,
+        // but must not destroy it.
+        void setCallback(std::function<void()> cb)
+        {
+            callback = std::move(cb);
+        }
+
+        bool armed() const
+        {
+            return next != nullptr;
+        }
+
+    private:
+        friend class TimerWheel;
+        uint64_t expires = 0; // tick
+        std::function<void()> callback;
+    };
+
+    TimerWheel(int64_t tickNs, int64_t nowNs) : tick(tickNs), current(static_cast<uint64_t>(nowNs / tickNs))
+    {
+        for (auto &level : slots)
+        {
+            for (auto &slot : level)
+                slot.prev = slot.next = &slot;
+        }
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    size_t size() const
+    {
+        return armedCount;
+    }
+
+    // Arms the timer for `deadlineNs` (steady clock), moving it if it was armed.
+    // It never fires early; at most one tick late.
+    void schedule(Timer &timer, int64_t deadlineNs)
+    {
+        if (timer.armed())
+            cancel(timer);
+        int64_t ticks = (deadlineNs + tick - 1) / tick;
+        timer.expires = ticks > 0 ? static_cast<uint64_t>(ticks) : 0;
+        place(timer);
+        ++armedCount;
+    }
+
+    void cancel(Timer &timer)
+    {
+        if (!timer.armed())
+            return;
+        unlink(timer);
+        --armedCount;
+    }
+
+    // Fires every timer due by `nowNs`; returns how many fired
+    size_t advance(int64_t nowNs)
+    {
+        uint64_t target = static_cast<uint64_t>(nowNs / tick);
+        if (armedCount == 0)
+        {
+            if (target >= current)
+                current = target + 1; // nothing to walk past
+            return 0;
+        }
+        size_t fired = 0;
+        while (current <= target)
+        {
+            uint64_t index = current & (SLOTS - 1);
+            for (int level = 1; index == 0 && level < LEVELS; ++level)
+            {
+                index = (current >> (SLOT_BITS * level)) & (SLOTS - 1);
+                cascade(level, index);
+            }
+
+            // Detach the slot first: a callback that re-arms at or before now
+            // lands in the next tick's slot instead of this one
+            Link due;
+            splice(slots[0][current & (SLOTS - 1)], due);
+            occupied &= ~(uint64_t(1) << (current & (SLOTS - 1)));
+            ++current;
+            while (due.next != &due)
+            {
+                Timer &timer = static_cast<Timer &>(*due.next);
+                unlink(timer);
+                --armedCount;
+                ++fired;
+                if (timer.callback)
+                    timer.callback();
+            }
+            if (armedCount == 0 && current <= target)
+                current = target + 1;
+        }
+        return fired;
+    }
+
+    // How long an epoll_wait may sleep before advance() has work: until the
+    // next occupied level-0 slot, else the next cascade. -1 with no timers.
+    int timeoutMs(int64_t nowNs) const
+    {
+        if (armedCount == 0)
+            return -1;
+        uint64_t wake = current + (SLOTS - (current & (SLOTS - 1)));
+        if (occupied)
+        {
+            // Rotate so bit 0 is the current tick's slot, then find the first one set
+            unsigned shift = current & (SLOTS - 1);
+            uint64_t rotated = shift ? (occupied >> shift) | (occupied << (SLOTS - shift)) : occupied;
+            wake = current + __builtin_ctzll(rotated);
+        }
+        int64_t waitNs = static_cast<int64_t>(wake) * tick - nowNs;
+        if (waitNs <= 0)
+            return 0;
+        return static_cast<int>((waitNs + 999999) / 1000000);
+    }
+
+private:
+    int64_t tick;
+    uint64_t current;      // next tick to process; everything before it has fired
+    uint64_t occupied = 0; // level-0 slots that may hold timers, bit per slot
+    size_t armedCount = 0;
+    Link slots[LEVELS][SLOTS]; // list heads; a slot's timers hang off its head in a ring
+
+    // The level whose slot range still holds the deadline, relative to now
+    void place(Timer &timer)
+    {
+        uint64_t expires = timer.expires < current ? current : timer.expires;
+        uint64_t delta = expires - current;
+        if (delta >= MAX_TICKS)
+        {
+            expires = current + MAX_TICKS - 1;
+            delta = MAX_TICKS - 1;
+        }
+        int level = 0;
+        while (level + 1 < LEVELS && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1))))
+            ++level;
+        uint64_t index = (expires >> (SLOT_BITS * level)) & (SLOTS - 1);
+        if (level == 0)
+            occupied |= uint64_t(1) << index;
+        link(slots[level][index], timer);
+    }
+
+    // Moves a higher-level slot's timers down to where they now belong
+    void cascade(int level, uint64_t index)
+    {
+        Link moving;
+        splice(slots[level][index], moving);
+        while (moving.next != &moving)
+        {
+            Timer &timer = static_cast<Timer &>(*moving.next);
+            unlink(timer);
+            place(timer);
+        }
+    }
+
+    static void link(Link &head, Link &timer)
+    {
+        timer.prev = head.prev;
+        timer.next = &head;
+        head.prev->next = &timer;
+        head.prev = &timer;
+    }
+
+    static void unlink(Link &timer)
+    {
+        timer.prev->next = timer.next;
+        timer.next->prev = timer.prev;
+        timer.prev = timer.next = nullptr;
+    }
+
+    // Moves every timer from one ring to an empty one
+    static void splice(Link &from, Link &to)
+    {
+        if (from.next == &from)
+        {
+            to.prev = to.next = &to;
+            return;
+        }
+        to.next = from.next;
+        to.prev = from.prev;
+        to.next->prev = &to;
+        to.prev->next = &to;
+        from.prev = from.next = &from;
+    }
+};
@@ -0,0 +1,312 @@
+#pragma once
+
+// Sampled per-message tracing into per-thread ring buffers, dumped as Chrome
+// trace-event JSON (load it in chrome://tracing or ui.perfetto.dev).
+//
+// A Sample marks the root of one unit of work, such as handling a message.
+// While tracing is on, every Nth sample on a thread is recorded, and Spans
+// and TimedLocks inside it record how long each stage, lock wait and lock
+// hold took. Outside a recorded sample a Span costs one thread-local load;
+// with tracing off a Sample costs one relaxed atomic load as well.
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <unistd.h>
+
+namespace Trace
+{
+    constexpr size_t RING_EVENTS = 4096;          // per thread; the oldest events are overwritten
+    constexpr size_t MAX_EVENTS_PER_SAMPLE = 512; // caps a fan-out to a huge room
+
+    struct Event
+    {
+        const char *name;     // string literals only
+        const char *category;
+        int64_t startNs;
+        int64_t durNs;
+        int64_t value;        // shown as args.value when >= 0
+    };
+
+    namespace detail
+    {
+        inline std::atomic<uint32_t> sampleEvery{0}; // 0 = off
+
+        inline thread_local bool recording = false; // inside a sampled Sample
+        inline thread_local uint32_t countdown = 0;
+        inline thread_local size_t sampleEvents = 0;
+        inline thread_local size_t sampleDropped = 0;
+
+        struct Ring
+        {
+            std::mutex mutex; // the owner takes it per event, a dump to read
+            Event events[RING_EVENTS];
+            uint64_t written = 0;
+            uint32_t tid = 0;
+            std::atomic<bool> inUse{true};
+            Ring *next = nullptr;
+        };
+
+        // Deliberately leaked, like the other per-thread registries
+        inline std::atomic<Ring *> &rings()
+        {
+            static auto *head = new std::atomic<Ring *>(nullptr);
+            return *head;
+        }
+
+        inline Ring *acquireRing()
+        {
+            static std::atomic<uint32_t> nextTid{1};
+            for (Ring *r = rings().load(); r; r = r->next)
+            {
+                bool expected = false;
+                if (!r->inUse.load(std::memory_order_relaxed) && r->inUse.compare_exchange_strong(expected, true))
+                    return r; // keeps its events and tid; the next owner continues the ring
+            }
+            Ring *r = new Ring;
+            r->tid = nextTid++;
+            r->next = rings().load();
+            while (!rings().compare_exchange_weak(r->next, r))
+            {
+            }
+            return r;
+        }
+
+        struct RingHolder
+        {
+            Ring *ring = nullptr;
+            ~RingHolder()
+            {
+                if (ring)
+                    ring->inUse.store(false);
+            }
+        };
+
+        // Allocated on the thread's first recorded event
+        inline Ring &localRing()
+        {
+            thread_local RingHolder holder;
+            if (!holder.ring)
+                holder.ring = acquireRing();
+            return *holder.ring;
+        }
+
+        inline int64_t nowNs()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        inline void record(const char *name, const char *category, int64_t start, int64_t end, int64_t value = -1)
+        {
+            if (sampleEvents >= MAX_EVENTS_PER_SAMPLE)
+            {
+                ++sampleDropped;
+                return;
+            }
+            ++sampleEvents;
+            Ring &ring = localRing();
+            std::lock_guard<std::mutex> lock(ring.mutex);
+            ring.events[ring.written++ % RING_EVENTS] = Event{name, category, start, end - start, value};
+        }
+
+        inline void writeJsonString(std::ostream &out, const char *s)
+        {
+            out << '"';
+            for (; *s; ++s)
+            {
+                if (*s == '"' || *s == '\\')
+                    out << '\\';
+                out << *s;
+            }
+            out << '"';
+        }
+    }
+
+    // Records one in `every` samples per thread; 0 turns tracing off
+    inline void setSampling(uint32_t every)
+    {
+        detail::sampleEvery.store(every, std::memory_order_relaxed);
+    }
+
+    inline uint32_t sampling()
+    {
+        return detail::sampleEvery.load(std::memory_order_relaxed);
+    }
+
+    // Root of one traced unit of work. Nested inside a recorded sample it is
+    // just another span.
+    class Sample
+    {
+    public:
+        explicit Sample(const char *n) : name(n)
+        {
+            uint32_t every = detail::sampleEvery.load(std::memory_order_relaxed);
+            if (every == 0)
+                return;
+            if (detail::recording)
+            {
+                start = detail::nowNs();
+                return;
+            }
+            if (detail::countdown > 0 && --detail::countdown > 0)
+                return;
+            detail::countdown = every;
+            detail::recording = true;
+            detail::sampleEvents = 0;
+            detail::sampleDropped = 0;
+            root = true;
+            start = detail::nowNs();
+        }
+
+        ~Sample()
+        {
+            if (start == 0)
+                return;
+            // The root is written last and carries how many events the cap dropped
+            if (root)
+            {
+                detail::sampleEvents = 0;
+                detail::record(name, "sample", start, detail::nowNs(), static_cast<int64_t>(detail::sampleDropped));
+                detail::recording = false;
+            }
+            else
+                detail::record(name, "stage", start, detail::nowNs());
+        }
+
+        Sample(const Sample &) = delete;
+        Sample &operator=(const Sample &) = delete;
+
+    private:
+        const char *name;
+        int64_t start = 0;
+        bool root = false;
+    };
+
+    // One stage of a recorded sample; `value` (a count, a size) shows up in the trace's args
+    class Span
+    {
+    public:
+        explicit Span(const char *n, int64_t v = -1) : name(n), value(v)
+        {
+            if (detail::recording)
+                start = detail::nowNs();
+        }
+
+        ~Span()
+        {
+            if (start != 0 && detail::recording)
+                detail::record(name, "stage", start, detail::nowNs(), value);
+        }
+
+        void setValue(int64_t v)
+        {
+            value = v;
+        }
+
+        Span(const Span &) = delete;
+        Span &operator=(const Span &) = delete;
+
+    private:
+        const char *name;
+        int64_t value;
+        int64_t start = 0;
+    };
+
+    // lock_guard that, inside a recorded sample, records the wait for the
+    // mutex and how long it was held as two events
+    template <typename Mutex>
+    class TimedLock
+    {
+    public:
+        TimedLock(Mutex &m, const char *waitName, const char *hold) : mutex(m), holdName(hold)
+        {
+            if (!detail::recording)
+            {
+                mutex.lock();
+                return;
+            }
+            int64_t asked = detail::nowNs();
+            mutex.lock();
+            acquired = detail::nowNs();
+            detail::record(waitName, "lock", asked, acquired);
+        }
+
+        ~TimedLock()
+        {
+            if (acquired == 0)
+            {
+                mutex.unlock();
+                return;
+            }
+            int64_t released = detail::nowNs();
+            mutex.unlock();
+            if (detail::recording)
+                detail::record(holdName, "lock", acquired, released);
+        }
+
+        TimedLock(const TimedLock &) = delete;
+        TimedLock &operator=(const TimedLock &) = delete;
+
+    private:
+        Mutex &mutex;
+        const char *holdName;
+        int64_t acquired = 0;
+    };
+
+    // Buffered events across all threads
+    inline size_t bufferedEvents()
+    {
+        size_t total = 0;
+        for (detail::Ring *r = detail::rings().load(); r; r = r->next)
+        {
+            std::lock_guard<std::mutex> lock(r->mutex);
+            total += r->written < RING_EVENTS ? r->written : RING_EVENTS;
+        }
+        return total;
+    }
+
+    // Writes every buffered event as Chrome trace-event JSON ("X" complete
+    // events, microsecond timestamps); returns how many were written
+    inline size_t dumpChromeJson(std::ostream &out)
+    {
+        size_t count = 0;
+        int pid = static_cast<int>(getpid());
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        for (detail::Ring *r = detail::rings().load(); r; r = r->next)
+        {
+            std::lock_guard<std::mutex> lock(r->mutex);
+            uint64_t first = r->written > RING_EVENTS ? r->written - RING_EVENTS : 0;
+            for (uint64_t i = first; i < r->written; ++i)
+            {
+                const Event &e = r->events[i % RING_EVENTS];
+                out << (count++ ? ",\n" : "\n") << "{\"name\":";
+                detail::writeJsonString(out, e.name);
+                out << ",\"cat\":";
+                detail::writeJsonString(out, e.category);
+                out << ",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << r->tid << ",\"ts\":" << e.startNs / 1000
+                    << "." << (e.startNs % 1000) / 100 << (e.startNs % 100) / 10 << e.startNs % 10
+                    << ",\"dur\":" << e.durNs / 1000 << "." << (e.durNs % 1000) / 100 << (e.durNs % 100) / 10
+                    << e.durNs % 10;
+                if (e.value >= 0)
+                    out << ",\"args\":{\"value\":" << e.value << "}";
+                out << "}";
+            }
+        }
+        out << "\n]}\n";
+        return count;
+    }
+
+    // Drops everything buffered, e.g. before a fresh capture
+    inline void clear()
+    {
+        for (detail::Ring *r = detail::rings().load(); r; r = r->next)
+        {
+            std::lock_guard<std::mutex> lock(r->mutex);
+            r->written = 0;
+        }
+    }
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+// Dense integer ids for usernames, and compact sets of them.
+//
+// A name has an id while something refers to it: the session registered
+// under it and every blocklist entry naming it each hold a reference. So a
+// blocklist entry keeps its id through the user reconnecting, and once the
+// last reference goes the id is freed for reuse; the table never outgrows the
+// live sessions plus the live blocklist entries. The message path only
+// compares ids: a broadcast reads the sender's id once and probes each
+// recipient's IdSet in O(1), however long the recipient's blocklist is.
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class UserIds
+{
+public:
+    // Takes a reference on the name's id, assigning a free one if it has none
+    uint32_t acquire(const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = ids.find(name);
+        if (found != ids.end())
+        {
+            ++entries[found->second].refs;
+            return found->second;
+        }
+        uint32_t id;
+        if (!freeIds.empty())
+        {
+            id = freeIds.back();
+            freeIds.pop_back();
+        }
+        else
+        {
+            id = static_cast<uint32_t>(entries.size());
+            entries.emplace_back();
+        }
+        entries[id].name = name;
+        entries[id].refs = 1;
+        ids.emplace(name, id);
+        return id;
+    }
+
+    // Drops a reference taken by acquire(); the last one frees the id
+    void release(uint32_t id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Entry &entry = entries[id];
+        if (--entry.refs > 0)
+            return;
+        ids.erase(entry.name);
+        std::string().swap(entry.name);
+        freeIds.push_back(id);
+    }
+
+    // Without taking a reference: false if the name has no id right now
+    bool find(const std::string &name, uint32_t &id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = ids.find(name);
+        if (found == ids.end())
+            return false;
+        id = found->second;
+        return true;
+    }
+
+    std::string name(uint32_t id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return id < entries.size() ? entries[id].name : std::string();
+    }
+
+    // Ids in use
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return ids.size();
+    }
+
+private:
+    struct Entry
+    {
+        std::string name;
+        uint32_t refs = 0;
+    };
+
+    std::mutex mutex; // taken on handshakes, disconnects and blocklist changes
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<Entry> entries;    // id -> name and reference count
+    std::vector<uint32_t> freeIds; // released ids, handed out again first
+};
+
+// Open-addressing hash set of ids with linear probing. Slots hold id + 1 so
+// that 0 marks an empty slot; the table is kept at most half full.
+class IdSet
+{
+public:
+    bool contains(uint32_t id) const
+    {
+        if (count == 0)
+            return false;
+        size_t mask = slots.size() - 1;
+        for (size_t i = slotFor(id, mask);; i = (i + 1) & mask)
+        {
+            if (slots[i] == id + 1)
+                return true;
+            if (slots[i] == 0)
+                return false;
+        }
+    }
+
+    // False if it was already there
+    bool insert(uint32_t id)
+    {
+        if (contains(id))
+            return false;
+        if ((count + 1) * 2 > slots.size())
+            rehash(slots.empty() ? 8 : slots.size() * 2);
+        place(id);
+        ++count;
+        return true;
+    }
+
+    // False if it was not there. Rebuilds the table, which keeps probing
+    // simple; blocklists change far less often than they are read.
+    bool erase(uint32_t id)
+    {
+        if (!contains(id))
+            return false;
+        std::vector<uint32_t> kept;
+        kept.reserve(count - 1);
+        forEach([&](uint32_t other) {
+            if (other != id)
+                kept.push_back(other);
+        });
+        slots.assign(slots.size(), 0);
+        count = 0;
+        for (uint32_t other : kept)
+        {
+            place(other);
+            ++count;
+        }
+        return true;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    template <typename Visit>
+    void forEach(Visit &&visit) const
+    {
+        for (uint32_t slot : slots)
+        {
+            if (slot != 0)
+                visit(slot - 1);
+        }
+    }
+
+private:
+    std::vector<uint32_t> slots; // size is a power of two
+    size_t count = 0;
+
+    static size_t slotFor(uint32_t id, size_t mask)
+    {
+        uint32_t h = id * 2654435761u;
+        return (h ^ (h >> 16)) & mask;
+    }
+
+    void place(uint32_t id)
+    {
+        size_t mask = slots.size() - 1;
+        size_t i = slotFor(id, mask);
+        while (slots[i] != 0)
+            i = (i + 1) & mask;
+        slots[i] = id + 1;
+    }
+
+    void rehash(size_t capacity)
+    {
+        std::vector<uint32_t> old;
+        old.swap(slots);
+        slots.assign(capacity, 0);
+        for (uint32_t slot : old)
+        {
+            if (slot != 0)
+                place(slot - 1);
+        }
+    }
+};